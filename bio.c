@@ -12,90 +12,529 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * bprefetch starts reading a block that will be wanted soon, and
+//     bread of it waits for that read rather than starting another.
+// * bread of a block that is not cached reads the uncached blocks
+//     around it in its segment too, NCLUSTER in all, in one go.
 // 
 // The implementation uses three state flags internally:
 // * B_BUSY: the block has been returned from bread
-//     and has not been passed back to brelse.  
+//     and has not been passed back to brelse.  It is guarded by the
+//     buffer's own lock, which processes waiting for it sleep on,
+//     queued on the buffer so brelse wakes only them.
 // * B_VALID: the buffer data has been initialized
 //     with the associated disk block contents.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// bwrite does not pick a disk address right away.  A pending block
+// is named by a temporary number from TEMPBASE up, which callers
+// store in inodes and the imap like any other address.  When the
+// log heads are flushed, each head's blocks are sorted by inode and
+// block, so every file lands in one run with its inode right after
+// its data.  The temporary numbers in pending metadata are then
+// replaced with the real ones, and trans[] keeps the mapping a while
+// longer for addresses still held elsewhere.  bget translates.
+//
+// Cloned files share blocks, so a block's live count is the number
+// of references to it.  Only written blocks are shared: a pending
+// one is written over in place.
+//
+// Data blocks that compress to under half a block are packed
+// NPACK to a block when they are placed, unless their file opted
+// out (B_RAW).  A packed block's buffer stays cached under its
+// PACKADDR name; bread fills it from the pack when it is not.
+//
+// Before that, data blocks are hashed and looked up in a fingerprint
+// index of blocks placed earlier.  One that matches byte for byte
+// shares the earlier block instead of taking a slot.  The index is
+// direct-mapped, dedup.size entries of at most NDEDUP, and only holds
+// blocks placed since their segment was last cleaned, so what is on
+// disk at an indexed address is the block that was placed there.
+//
+// Each mounted volume has a segment writer of its own (segs[]), so
+// volumes on different disks flush without waiting for each other.
+//
+// Buffers are replaced 2Q style, so a big sequential read or a
+// segment's worth of writes passing through does not flush the
+// blocks used over and over (the imap, inodes, directories).  A
+// block read for the first time goes on the in queue, FIFO, and a
+// hit there does not move it.  When it is evicted from in, its name
+// is kept on the ghost list; if it is read again while it is still
+// there, it goes on the main queue, LRU.  Victims come from in while
+// in holds more than a quarter of the buffers, from main otherwise.
+//
+// Buffer data lives in kalloc pages, BPERPAGE buffers to a page.  binit
+// takes BCACHEPCT percent of the free pages, and at least BUFMIN
+// buffers' worth, which is NBUF plus what the log heads can hold
+// pending.  When kalloc runs dry it takes pages back (bshrink), down
+// to BUFMIN; a miss grows the cache again while memory is plentiful.
+//
+// Named buffers and ghosts are found through hash chains on (dev,
+// block), so a lookup costs the same however big the cache is.
+// Buffers are only renamed through bname, which keeps the chains.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "stat.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "fs.h"
 
-#define BUFSIZE NBUF + SEGBLOCKS
+#if BSIZE > PGSIZE
+#error "buffers are carved out of kalloc pages: BSIZE must be at most PGSIZE"
+#endif
+
+#define BUFMIN (NBUF + NMOUNT * NHEADS * (SEGMETABLOCKS + PARTBLOCKS))
+#define MAXBUF (PHYSTOP / BSIZE) // room for a buffer per block of memory
+#define BPERPAGE (PGSIZE / BSIZE)
+#define BGROWSLACK 64 // free pages to leave when growing the cache
+#define TEMPBASE 0x80000000 // pending blocks are named from here up
+#define NTRANS (2 * NMOUNT * NHEADS * PARTBLOCKS)
+#define NGHOST (MAXBUF / 2) // names remembered after eviction from in
+#define NBHASH 1024 // hash chains, for buffers and for ghosts
+#define BHASH(dev, block) (((block) ^ (dev) << 8) % NBHASH)
+
+#define BUFLOCK(b) (&bcache.locks[(b) - bcache.buf])
+
+#define Q_IN 0 // read once: FIFO
+#define Q_MAIN 1 // read again after leaving in: LRU
+
+struct ghost {
+  uint dev;
+  block_t block; // 0 if the entry is empty
+  struct ghost *hnext;
+};
 
 struct {
   struct spinlock lock;
-  struct buf buf[BUFSIZE];
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  // Buffers with data point into a page shared with the ones next
+  // to them, BPERPAGE from a multiple of BPERPAGE; the rest have
+  // none.  Only the first top are ever used.
+  struct buf buf[MAXBUF];
+  struct spinlock locks[MAXBUF]; // each buffer's B_BUSY and waiters
+  int top;
+  int nbuf; // buffers with data
+  int want; // what binit sized the cache to
+  // The two queues, each a list through prev/next.
+  // q[i].next is the newest.
+  struct buf q[2];
+  int n[2]; // buffers on each queue
+  struct buf *hash[NBHASH]; // buffers with a block, through hnext
+  struct ghost ghost[NGHOST]; // recently evicted from in, a ring of nbuf/2
+  struct ghost *ghash[NBHASH];
+  uint gnext; // next ghost entry to take
+  int ahead; // prefetches in flight
 } bcache;
 
-struct {
+// An open segment being filled by one log head.
+struct loghead {
+  block_t base; // first block of the segment being filled
+  block_t start; // where the pending partial segment will be written
+  uint count; // number of blocks already copied into data
+  uint crc; // of the blocks, as handed to the disk
+  struct buf * blocks[PARTBLOCKS];
+};
+
+// A fingerprint index entry.
+struct fingerprint {
+  uint64 hash;
+  block_t addr; // 0 if the entry is empty
+  struct buf *b; // the block's buffer, during flush gen
+  uint gen;
+};
+
+// The segment writer of one mounted volume, in the slot lfsvol()
+// gives its device.  Volumes flush independently; what is guarded
+// by busy is only the flushing writer's.
+struct segwriter {
+  uint dev;
   uchar busy; // is writing?
   struct spinlock lock;
-  block_t start; // where seg will be written
-  uint count; // number of blocks already copied into data
-  struct buf * blocks[SEGDATABLOCKS];
-} seg;
+  struct loghead head[NHEADS];
+  block_t imap; // imap, ninodes and ilgen as of the last complete flush
+  uint ninodes;
+  uint ilgen;
+  uint cutgen; // intent log generation the flush absorbs, guarded by busy
+  // meta block staging for segwrite and checkpoint, guarded by busy
+  struct buf meta;
+  uchar metadata[BSIZE];
+  // every head's blocks on their way to disk, and their flags from
+  // before, guarded by busy
+  struct buf *io[NHEADS * PARTBLOCKS];
+  int ioflags[NHEADS * PARTBLOCKS];
+  // compressor output, guarded by busy
+  uchar ztmp[BSIZE];
+  // fingerprint index, guarded by busy
+  struct {
+    uint size; // entries in use, 0 to turn deduplication off
+    uint gen; // counts flushes
+    struct fingerprint fp[NDEDUP];
+  } dedup;
+};
+
+static struct segwriter segs[NMOUNT];
+
+// Temporary numbers are handed out across all volumes, so one
+// table maps them to where they went.
+struct {
+  struct spinlock lock;
+  block_t nexttemp; // next temporary block number
+  struct {
+    block_t temp;
+    block_t final;
+  } trans[NTRANS]; // recent temporary numbers and where they went
+} temps;
+
+// lz.c's match table is shared by the writers
+static struct spinlock zlock;
 
-static void waitseg(void)
+static void segwrite(struct segwriter*);
+static struct buf* bnew(uint, block_t);
+
+// The segment writer of dev, or 0 if it is not mounted.
+static struct segwriter*
+segof(uint dev)
+{
+  int v;
+
+  if ((v = lfsvol(dev)) < 0)
+    return 0;
+  return &segs[v];
+}
+
+// Wait out a flush of dev's volume.
+static void waitseg(uint dev)
 {
-  if (seg.busy != 1)
+  struct segwriter *seg = segof(dev);
+
+  if (seg == 0 || seg->busy != 1)
     return;
-  acquire(&seg.lock);
-  while (seg.busy == 1)
-    sleep(&seg, &seg.lock);
-  release(&seg.lock);
+  acquire(&seg->lock);
+  while (seg->busy == 1)
+    sleep(seg, &seg->lock);
+  release(&seg->lock);
+}
+
+// Put b at the new end of queue q.  Caller holds bcache.lock.
+static void
+bpush(struct buf *b, int q)
+{
+  b->q = q;
+  b->next = bcache.q[q].next;
+  b->prev = &bcache.q[q];
+  bcache.q[q].next->prev = b;
+  bcache.q[q].next = b;
+  bcache.n[q]++;
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  bcache.n[b->q]--;
+}
+
+// b has been used: on main that makes it the most recent.
+static void
+btouch(struct buf *b)
+{
+  if(b->q == Q_MAIN){
+    bunlink(b);
+    bpush(b, Q_MAIN);
+  }
+}
+
+// Clear B_BUSY and wake the processes waiting for it.
+static void
+bunlock(struct buf *b)
+{
+  acquire(BUFLOCK(b));
+  b->flags &= ~B_BUSY;
+  wakeupq(&b->waiters);
+  release(BUFLOCK(b));
+}
+
+// The buffer named block of dev, or 0 if it is not cached.
+// Caller holds bcache.lock.
+static struct buf*
+bfind(uint dev, block_t block)
+{
+  struct buf *b;
+
+  for(b = bcache.hash[BHASH(dev, block)]; b; b = b->hnext)
+    if(b->dev == dev && b->block == block)
+      return b;
+  return 0;
+}
+
+// Name b block of dev, moving it to that name's hash chain.  A block
+// of 0 leaves it nameless and on no chain.  Caller holds bcache.lock.
+static void
+bname(struct buf *b, uint dev, block_t block)
+{
+  struct buf **pp;
+
+  if(b->block != 0){
+    pp = &bcache.hash[BHASH(b->dev, b->block)];
+    while(*pp != b){
+      if(*pp == 0)
+        panic("bname");
+      pp = &(*pp)->hnext;
+    }
+    *pp = b->hnext;
+  }
+  b->dev = dev;
+  b->block = block;
+  if(block != 0){
+    b->hnext = bcache.hash[BHASH(dev, block)];
+    bcache.hash[BHASH(dev, block)] = b;
+  }
+}
+
+static void
+gunlink(struct ghost *g)
+{
+  struct ghost **pp;
+
+  for(pp = &bcache.ghash[BHASH(g->dev, g->block)]; *pp != g; pp = &(*pp)->hnext)
+    ;
+  *pp = g->hnext;
+  g->block = 0;
+}
+
+// Remember that block of dev was evicted from in, in place of the
+// oldest ghost.
+static void
+bghostadd(uint dev, block_t block)
+{
+  struct ghost *g = &bcache.ghost[bcache.gnext];
+
+  if(g->block != 0)
+    gunlink(g);
+  g->dev = dev;
+  g->block = block;
+  g->hnext = bcache.ghash[BHASH(dev, block)];
+  bcache.ghash[BHASH(dev, block)] = g;
+  bcache.gnext = (bcache.gnext + 1) % (bcache.nbuf / 2);
+}
+
+// Was block of dev evicted from in lately?  Forgets it if so.
+static int
+bghost(uint dev, block_t block)
+{
+  struct ghost *g;
+
+  for(g = bcache.ghash[BHASH(dev, block)]; g; g = g->hnext)
+    if(g->block == block && g->dev == dev){
+      gunlink(g);
+      return 1;
+    }
+  return 0;
+}
+
+// Take a free buffer for block of dev (0 for none yet), evicting
+// what it held, and queue it as the block's history says.  Returns
+// 0 if every buffer is busy or dirty.  Caller holds bcache.lock.
+static struct buf*
+bvictim(uint dev, block_t block)
+{
+  struct buf *b;
+  int i, q;
+
+  q = bcache.n[Q_IN] > bcache.nbuf / 4 ? Q_IN : Q_MAIN;
+  for(i = 0; i < 2; i++, q ^= 1){
+    for(b = bcache.q[q].prev; b != &bcache.q[q]; b = b->prev){
+      if(b->flags & (B_BUSY|B_DIRTY))
+        continue;
+      acquire(BUFLOCK(b));
+      if((b->flags & (B_BUSY|B_DIRTY)) == 0)
+        goto found;
+      release(BUFLOCK(b));
+    }
+  }
+  return 0;
+
+found:
+  if(q == Q_IN && (b->flags & B_VALID) && b->block != 0)
+    bghostadd(b->dev, b->block);
+  bunlink(b);
+  if(block != 0 && bghost(dev, block)){
+    lfsstat.bghosts++;
+    bpush(b, Q_MAIN);
+  } else
+    bpush(b, Q_IN);
+  bname(b, dev, block);
+  b->flags = B_BUSY;
+  release(BUFLOCK(b));
+  return b;
+}
+
+// Add a page's worth of empty buffers to the cache, if kalloc has
+// more than BGROWSLACK pages free.  Returns 0 if it did not.
+static int
+bgrow(void)
+{
+  struct buf *b;
+  char *p;
+  int i;
+
+  if(kfreepages() <= BGROWSLACK || (p = kalloc()) == 0)
+    return 0;
+  acquire(&bcache.lock);
+  for(b = bcache.buf; b < bcache.buf+MAXBUF; b += BPERPAGE)
+    if(b->data == 0)
+      break;
+  if(b == bcache.buf+MAXBUF){
+    release(&bcache.lock);
+    kfree(p);
+    return 0;
+  }
+  // empty buffers go at the old end of in, to be taken first
+  for(i = 0; i < BPERPAGE; i++, b++){
+    b->data = (uchar*)p + i*BSIZE;
+    b->dev = -1;
+    b->block = 0;
+    b->flags = 0;
+    b->q = Q_IN;
+    b->prev = bcache.q[Q_IN].prev;
+    b->next = &bcache.q[Q_IN];
+    bcache.q[Q_IN].prev->next = b;
+    bcache.q[Q_IN].prev = b;
+    bcache.n[Q_IN]++;
+  }
+  if(b - bcache.buf > bcache.top)
+    bcache.top = b - bcache.buf;
+  bcache.nbuf += BPERPAGE;
+  lfsstat.nbuf = bcache.nbuf;
+  release(&bcache.lock);
+  return 1;
+}
+
+// Give kalloc back a page whose buffers are all free and clean,
+// least recently used first, unless the cache is down to BUFMIN.
+// Returns 0 if there was none.
+int
+bshrink(void)
+{
+  struct buf *b, *pb;
+  char *p;
+  int i, q;
+
+  if(bcache.nbuf == 0)
+    return 0; // before binit
+  acquire(&bcache.lock);
+  if(bcache.nbuf - BPERPAGE < BUFMIN)
+    goto none;
+  for(q = Q_IN; q <= Q_MAIN; q++)
+    for(b = bcache.q[q].prev; b != &bcache.q[q]; b = b->prev){
+      pb = bcache.buf + (b - bcache.buf) / BPERPAGE * BPERPAGE;
+      for(i = 0; i < BPERPAGE; i++){
+        acquire(BUFLOCK(&pb[i]));
+        if(pb[i].flags & (B_BUSY|B_DIRTY))
+          break;
+      }
+      if(i == BPERPAGE)
+        goto found;
+      while(i >= 0)
+        release(BUFLOCK(&pb[i--]));
+    }
+none:
+  release(&bcache.lock);
+  return 0;
+
+found:
+  p = (char*)pb[0].data;
+  for(i = 0; i < BPERPAGE; i++){
+    bunlink(&pb[i]);
+    bname(&pb[i], -1, 0);
+    pb[i].flags = 0;
+    pb[i].data = 0;
+    release(BUFLOCK(&pb[i]));
+  }
+  bcache.nbuf -= BPERPAGE;
+  // ghosts past the end of the smaller ring are forgotten
+  for(i = bcache.nbuf / 2; i < (bcache.nbuf + BPERPAGE) / 2; i++)
+    if(bcache.ghost[i].block != 0)
+      gunlink(&bcache.ghost[i]);
+  bcache.gnext %= bcache.nbuf / 2;
+  lfsstat.nbuf = bcache.nbuf;
+  release(&bcache.lock);
+  kfree(p);
+  return 1;
 }
 
 void
 binit(void)
 {
   struct buf *b;
+  struct segwriter *seg;
 
   initlock(&bcache.lock, "bcache");
-  initlock(&seg.lock, "seg");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+BUFSIZE; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    b->dev = -1;
-    b->flags = 0;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for(b = bcache.buf; b < bcache.buf+MAXBUF; b++)
+    initlock(BUFLOCK(b), "buf");
+  initlock(&temps.lock, "temps");
+  initlock(&zlock, "lz");
+
+  bcache.q[Q_IN].prev = bcache.q[Q_IN].next = &bcache.q[Q_IN];
+  bcache.q[Q_MAIN].prev = bcache.q[Q_MAIN].next = &bcache.q[Q_MAIN];
+  bcache.want = kfreepages() * BCACHEPCT / 100 * BPERPAGE;
+  if(bcache.want < BUFMIN)
+    bcache.want = BUFMIN;
+  if(bcache.want > MAXBUF)
+    bcache.want = MAXBUF;
+  while(bcache.nbuf < bcache.want && bgrow())
+    ;
+  if(bcache.nbuf < BUFMIN)
+    panic("binit: no memory for buffers");
+
+  for (seg = segs; seg < segs + NMOUNT; seg++) {
+    seg->meta.data = seg->metadata;
+    initlock(&seg->lock, "seg");
+    memset(seg->head, 0, sizeof(seg->head));
+    seg->dedup.size = NDEDUP;
   }
+  temps.nexttemp = TEMPBASE;
+}
 
-  seg.start = seg.count = 0;
-  memset(seg.blocks, 0, sizeof(seg.blocks));
+// Where the block named b was written, if b is a temporary number
+// that has been flushed.
+block_t
+btrans(block_t b)
+{
+  uint i;
+
+  if (b < TEMPBASE)
+    return b;
+  i = (b - TEMPBASE) % NTRANS;
+  if (temps.trans[i].temp == b)
+    return temps.trans[i].final;
+  return b;
 }
 
 // Return a new, locked buf without an assigned block
 struct buf*
 balloc(uint dev)
 {
-  waitseg();
+  waitseg(dev);
+  return bnew(dev, 0);
+}
+
+// balloc for the segment writer, which cannot wait for itself,
+// and for bget, naming the block the buffer is for.
+static struct buf*
+bnew(uint dev, block_t block)
+{
   struct buf * b;
+  if(bcache.nbuf < bcache.want)
+    bgrow();
   acquire(&bcache.lock);
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if((b->flags & B_BUSY) == 0 && (b->flags & B_DIRTY) == 0){
-      b->dev = dev;
-      b->block = 0;
-      b->flags = B_BUSY;
-      release(&bcache.lock);
-      return b;
-    }
-  }
-  panic("balloc: no free buffers");
+  if((b = bvictim(dev, block)) == 0)
+    panic("balloc: no free buffers");
+  release(&bcache.lock);
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
@@ -107,47 +546,175 @@ bget(uint dev, block_t block)
   if (block == 0)
     panic("bget: invalid block");
  
-  waitseg();
+  waitseg(dev);
+  block = btrans(block);
+  struct segwriter *seg = segof(dev);
   struct buf *b;  
   acquire(&bcache.lock);
 
 loop:
   // Try for cached block.
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->block == block){
-      if(!(b->flags & B_BUSY)){
-        b->flags |= B_BUSY;
-        release(&bcache.lock);
-        return b;
-      }
-      sleep(b, &bcache.lock);
+  if((b = bfind(dev, block)) != 0){
+    lfsstat.bhits++;
+    acquire(BUFLOCK(b));
+    release(&bcache.lock);
+    while(b->flags & B_BUSY)
+      sleepq(&b->waiters, BUFLOCK(b));
+    // it may have been taken for another block meanwhile
+    if(b->dev != dev || b->block != block){
+      release(BUFLOCK(b));
+      acquire(&bcache.lock);
       goto loop;
     }
+    b->flags |= B_BUSY;
+    release(BUFLOCK(b));
+    return b;
   }
   
   release(&bcache.lock);
 
-  if (seg.start !=0 && block > seg.start && block < seg.start + SEGBLOCKS)
-    panic("bget: block in new seg range.");
+  struct loghead *h;
+  for (h = seg ? seg->head : 0; seg && h < seg->head + NHEADS; h++)
+    if (h->start != 0 && block > h->start && block < h->base + SEGBLOCKS)
+      panic("bget: block in new seg range.");
   
-  b = balloc(dev);
-  b->block = block;
-  return b;
+  lfsstat.bmisses++;
+  return bnew(dev, block);
 }
+// Fill b, which names a block in a pack, from the pack.
+static void
+bunpack(struct buf *b)
+{
+  struct buf *pb;
+  struct pack_entry *e;
+  struct disk_pack *p;
+
+  pb = bread(b->dev, PACKBLOCK(b->block));
+  p = (struct disk_pack *)pb->data;
+  e = &p->entries[PACKSLOT(b->block)];
+  if (e->off + e->len > sizeof(p->data) ||
+      lzdecompress(p->data + e->off, e->len, b->data, BSIZE) != BSIZE)
+    panic("bunpack");
+  brelse(pb);
+  b->flags |= B_VALID;
+}
+
+// A prefetch is done: release b as brelse does, from ideintr.
+static void
+bdone(struct buf *b)
+{
+  acquire(&bcache.lock);
+  btouch(b);
+  bcache.ahead--;
+  release(&bcache.lock);
+  bunlock(b);
+}
+
+// Start reading the disk block holding block into the cache, unless
+// it is there or NREADAHEAD reads are already on their way.
+void
+bprefetch(uint dev, block_t block)
+{
+  struct buf *b;
+
+  block = PACKBLOCK(btrans(block));
+  if (block == 0 || block >= TEMPBASE)
+    return;
+  acquire(&bcache.lock);
+  if (bcache.ahead >= NREADAHEAD)
+    goto out;
+  if (bfind(dev, block))
+    goto out;
+  if ((b = bvictim(dev, block)) != 0) {
+    bcache.ahead++;
+    release(&bcache.lock);
+    // busy until bdone, so bread of it sleeps until then
+    idesubmit(&b, 1, bdone);
+    return;
+  }
+out:
+  release(&bcache.lock);
+}
+
+// Read b, which missed, with the blocks of its NCLUSTER-aligned
+// window of its segment that are not cached, as clean entries: the
+// log writes a file's blocks next to each other and its inode right
+// after them.  Segments a log head is still filling are read alone,
+// since their blocks past the head are not written yet.
+static void
+bcluster(struct buf *b)
+{
+  struct buf *bs[NCLUSTER], *c;
+  struct segwriter *seg = segof(b->dev);
+  struct disk_superblock *sb;
+  block_t base, start, end, k;
+  int h, i, n;
+
+  n = 0;
+  bs[n++] = b;
+  if (seg == 0 || b->block < SEGSTART || b->block >= TEMPBASE)
+    goto read;
+  sb = getsb(b->dev);
+  base = SEG2B(B2SEG(b->block));
+  for (h = 0; h < NHEADS; h++)
+    if (B2SEG(sb->head[h]) == B2SEG(b->block) ||
+        (seg->head[h].start != 0 && seg->head[h].base == base))
+      goto read;
+  start = base + (b->block - base) / NCLUSTER * NCLUSTER;
+  end = start + NCLUSTER;
+  if (end > base + SEGBLOCKS)
+    end = base + SEGBLOCKS;
+
+  acquire(&bcache.lock);
+  for (k = start; k < end; k++) {
+    if (k == b->block || bfind(b->dev, k))
+      continue;
+    if ((c = bvictim(b->dev, k)) == 0)
+      break;
+    bs[n++] = c;
+  }
+  release(&bcache.lock);
+  lfsstat.bclustered += n - 1;
+
+read:
+  // the disk queue merges the run into as few commands as it can
+  iderwv(bs, n);
+  for (i = 1; i < n; i++)
+    bunlock(bs[i]);
+}
+
 // Return a B_BUSY buf with the contents of the indicated disk block.
 struct buf*
 bread(uint dev, block_t block)
 {
-  waitseg();
+  waitseg(dev);
   struct buf *b;
   b = bget(dev, block);
 
-  if(!(b->flags & B_VALID))
-    iderw(b);
+  if(!(b->flags & B_VALID)) {
+    if (PACKED(b->block))
+      bunpack(b);
+    else
+      bcluster(b);
+  }
 
   return b;
 }
 
+// Flush the pending blocks.  Called with seg->lock held and
+// returns with it released.
+static void
+segflush(struct segwriter *seg)
+{
+  seg->busy = 1;
+  release(&seg->lock);
+  segwrite(seg);
+  acquire(&seg->lock);
+  seg->busy = 0;
+  wakeup(seg);
+  release(&seg->lock);
+}
+
 block_t
 bwrite(struct buf *b)
 {
@@ -161,80 +728,689 @@ bwrite(struct buf *b)
     return 0;
   }
 
-  waitseg();
-  acquire(&seg.lock);
-  struct disk_superblock * sb = getsb();
+  if (b->head < 0 || b->head >= NHEADS)
+    panic("bwrite: log head");
 
-  // initialize new seg
-  if (seg.start == 0)
-    seg.start = sb->next;
+  struct disk_superblock * sb = getsb(b->dev);
+  struct segwriter *seg = segof(b->dev);
+  block_t temp;
+  waitseg(b->dev);
+  acquire(&seg->lock);
 
-  if ((b->flags & B_DIRTY) != 0 || (b->block > seg.start && b->block < seg.start + SEGBLOCKS)) {
-    release(&seg.lock);
+  if ((b->flags & B_DIRTY) != 0) {
+    release(&seg->lock);
     return b->block;
   }
 
-  seg.blocks[seg.count] = b;
-  b->block = seg.start + SEGMETABLOCKS + seg.count++;
-  b->flags |= B_DIRTY;
-
-  if (seg.count == SEGDATABLOCKS) {
-    cprintf("bio: Writing segment.\n");
-    seg.busy = 1;
-    release(&seg.lock);
-
-    // write zeroes for block metadata for now    
-    uint k;
-    struct buf meta;
-    memset(meta.data, 0, sizeof(meta.data));
-    meta.dev = ROOTDEV;
-    for (k = 0; k < SEGMETABLOCKS; k++) {
-      meta.flags = B_DIRTY | B_BUSY;
-      meta.block = seg.start + k;
-      iderw(&meta);
-    }
+  // initialize new seg
+  struct loghead *h = &seg->head[b->head];
+  if (h->start == 0) {
+    h->start = sb->head[b->head];
+    h->base = SEG2B(B2SEG(h->start));
+  }
 
-    for (k = 0; k < SEGDATABLOCKS; k++) {
-      int prevflags = seg.blocks[k]->flags;
-      seg.blocks[k]->flags = B_DIRTY | B_BUSY;
-      iderw(seg.blocks[k]);
-      seg.blocks[k]->flags = prevflags & (~B_DIRTY);
-    }
-    
-    sb->segment = seg.start;
-    sb->next += SEGBLOCKS;
-    sb->nsegs++;
-    sb->nblocks += SEGBLOCKS;
-
-    memset(seg.blocks, 0, sizeof(seg.blocks));
-    seg.count = seg.start = seg.busy = 0;
-    wakeup(&seg);
-  } else
-    release(&seg.lock);
+  h->blocks[h->count++] = b;
+  sutlive(b->dev, b->block, -1);
+  b->refs = 1;
+  acquire(&temps.lock);
+  temp = temps.nexttemp++;
+  if (temps.nexttemp == 0)
+    temps.nexttemp = TEMPBASE;
+  release(&temps.lock);
+  acquire(&bcache.lock);
+  bname(b, b->dev, temp);
+  release(&bcache.lock);
+  b->flags |= B_DIRTY | B_VALID;
+
+  if (h->count == PARTBLOCKS ||
+      h->start + SEGMETABLOCKS + h->count == h->base + SEGBLOCKS)
+    segflush(seg);
+  else
+    release(&seg->lock);
 
   return b->block;
 }
 
-// Release the buffer b.
+// Write out whatever is pending on dev as partial segments.
 void
-brelse(struct buf *b)
+bsync(uint dev)
 {
-  if((b->flags & B_BUSY) == 0)
-    panic("brelse");
+  struct segwriter *seg = segof(dev);
+  int h;
+
+  acquire(&seg->lock);
+  while (seg->busy == 1)
+    sleep(seg, &seg->lock);
+  for (h = 0; h < NHEADS; h++)
+    if (seg->head[h].count != 0)
+      break;
+  if (h == NHEADS) {
+    release(&seg->lock);
+    return;
+  }
+  segflush(seg);
+}
+
+// Add delta references to the block named b.  A pending block keeps
+// the count in its buffer until it has an address.
+static void
+bcount(uint dev, block_t b, int delta)
+{
+  struct segwriter *seg = segof(dev);
+  struct loghead *h;
+  uint i;
+
+  acquire(&seg->lock);
+  while (seg->busy == 1)
+    sleep(seg, &seg->lock);
+  b = btrans(b);
+  if (b >= TEMPBASE) {
+    for (h = seg->head; h < seg->head + NHEADS; h++)
+      for (i = 0; i < h->count; i++)
+        if (h->blocks[i]->dev == dev && h->blocks[i]->block == b)
+          h->blocks[i]->refs += delta;
+  } else
+    sutlive(dev, b, delta);
+  release(&seg->lock);
+}
+
+// Another file refers to block b.
+void
+bref(uint dev, block_t b)
+{
+  bcount(dev, b, 1);
+}
+
+// A file no longer refers to block b.
+void
+bunref(uint dev, block_t b)
+{
+  bcount(dev, b, -1);
+}
+
+// Drop cached copies of blocks start..start+n-1, which are about
+// to be rewritten behind the cache's back.
+void
+binval(uint dev, block_t start, uint n)
+{
+  struct buf *b;
 
-  waitseg();
   acquire(&bcache.lock);
+  for(b = bcache.buf; b < bcache.buf+bcache.top; b++)
+    if(b->dev == dev && PACKBLOCK(b->block) >= start && PACKBLOCK(b->block) < start + n){
+      acquire(BUFLOCK(b));
+      if((b->flags & (B_BUSY|B_DIRTY)) == 0){
+        bname(b, -1, 0);
+        b->flags = 0;
+      }
+      release(BUFLOCK(b));
+    }
+  release(&bcache.lock);
+}
 
-  b->next->prev = b->prev;
-  b->prev->next = b->next;
-  b->next = bcache.head.next;
+// Account for a partial segment of log head h that has reached
+// the disk.
+static void
+segadvance(struct disk_superblock *sb, int h, block_t start, struct seg_summary *sum)
+{
+  sb->serial = sum->serial;
+  sb->nblocks += SEGMETABLOCKS + sum->nblocks;
+  sb->head[h] = sum->next;
+  if (B2SEG(sum->next) != B2SEG(start))
+    sb->segment = SEG2B(B2SEG(start));
+}
 
-  b->prev = &bcache.head;
-  bcache.head.next->prev = b;
-  bcache.head.next = b;
+// Write seg->meta to block b.
+static void
+metawrite(struct segwriter *seg, block_t b)
+{
+  binval(seg->dev, b, 1);
+  seg->meta.dev = seg->dev;
+  seg->meta.block = b;
+  seg->meta.flags = B_DIRTY | B_BUSY;
+  iderw(&seg->meta);
+}
 
-  b->flags &= ~B_BUSY;
-  wakeup(b);
+// Write the in-memory superblock to block 1.
+static void
+checkpoint(struct segwriter *seg, struct disk_superblock *sb)
+{
+  memset(seg->meta.data, 0, BSIZE);
+  memmove(seg->meta.data, sb, sizeof(*sb));
+  metawrite(seg, 1);
+  lfsstat.devbytes += BSIZE;
+}
+
+// Queue the pending blocks of log head hi at io, checksumming them
+// on the way.  Returns how many there are.
+static int
+segdata(struct segwriter *seg, int hi, struct buf **io, int *ioflags)
+{
+  struct loghead *h = &seg->head[hi];
+  uint k;
 
+  h->crc = 0;
+  for (k = 0; k < h->count; k++) {
+    io[k] = h->blocks[k];
+    acquire(BUFLOCK(io[k]));
+    ioflags[k] = io[k]->flags;
+    io[k]->flags = B_DIRTY | B_BUSY;
+    release(BUFLOCK(io[k]));
+    h->crc = crc32c(h->crc, io[k]->data, BSIZE);
+  }
+  return h->count;
+}
+
+// Write the summary of log head hi, whose data segdata queued and
+// is on disk, so a summary on disk means its data made it too.
+// The summary carries the live imap only if it is the last one of
+// the flush; earlier ones carry the imap of the previous flush, whose
+// blocks are all on disk.  Returns 1 if the segment filled up.
+static int
+segwritehead(struct segwriter *seg, int hi, int last)
+{
+  struct disk_superblock *sb = getsb(seg->dev);
+  struct seg_summary *sum = (struct seg_summary *)seg->meta.data;
+  struct loghead *h = &seg->head[hi];
+  block_t next;
+  uint k;
+
+  memset(seg->meta.data, 0, BSIZE);
+  for (k = 1; k < SEGMETABLOCKS; k++)
+    metawrite(seg, h->start + k);
+
+  for (k = 0; k < h->count; k++) {
+    sum->entries[k].inum = h->blocks[k]->inum;
+    sum->entries[k].bn = h->blocks[k]->bn;
+  }
+
+  // move to a fresh segment if not even one more block would fit
+  next = h->start + SEGMETABLOCKS + h->count;
+  if (next + SEGMETABLOCKS >= h->base + SEGBLOCKS)
+    next = SEG2B(segalloc(seg->dev, B2SEG(h->base)));
+
+  sum->magic = SUMMAGIC;
+  sum->datacrc = h->crc;
+  sum->serial = sb->serial + 1;
+  sum->nblocks = h->count;
+  sum->next = next;
+  sum->imap = last ? sb->imap : seg->imap;
+  sum->ninodes = last ? sb->ninodes : seg->ninodes;
+  sum->ilgen = last ? seg->cutgen : seg->ilgen;
+  sum->sumcrc = crc32c(0, sum, sizeof(*sum));
+  metawrite(seg, h->start);
+  sutwritten(seg->dev, h->start, sum->serial);
+  lfsstat.devbytes += (SEGMETABLOCKS + h->count) * BSIZE;
+
+  segadvance(sb, hi, h->start, sum);
+  memset(h->blocks, 0, sizeof(h->blocks));
+  h->count = 0;
+  h->start = next;
+  if (B2SEG(next) == B2SEG(h->base))
+    return 0;
+  h->base = next;
+  return 1;
+}
+
+// Summary order: by inode, then block, with the inode after its
+// data.  The imap (inode 0) goes last.
+static int
+segbefore(struct buf *a, struct buf *b)
+{
+  uint ai = a->inum - 1, bi = b->inum - 1;
+
+  if (ai != bi)
+    return ai < bi;
+  return a->bn < b->bn;
+}
+
+// 64-bit FNV-1a, a word at a time.
+static uint64
+bhash(uchar *data)
+{
+  uint64 h;
+  uint *w;
+
+  h = 0xcbf29ce484222325ULL;
+  for (w = (uint *)data; w < (uint *)(data + BSIZE); w++) {
+    h ^= *w;
+    h *= 0x100000001b3ULL;
+  }
+  return h ^ (h >> 29);
+}
+
+// Is the block at addr, placed in an earlier flush, the same as
+// data?  Only a cached copy is compared, expanded if addr is in a
+// pack: reading the disk here would hold every writer of the volume
+// up behind a random read.
+static int
+dedupsame(struct segwriter *seg, block_t addr, uchar *data)
+{
+  struct buf *c;
+  int same;
+
+  acquire(&bcache.lock);
+  if ((c = bfind(seg->dev, addr)) != 0)
+    acquire(BUFLOCK(c));
   release(&bcache.lock);
+  if (c == 0)
+    return 0;
+  if ((c->flags & (B_BUSY|B_VALID)) != B_VALID) {
+    release(BUFLOCK(c));
+    return 0;
+  }
+  c->flags |= B_BUSY;
+  release(BUFLOCK(c));
+  same = memcmp(c->data, data, BSIZE) == 0;
+  bunlock(c);
+  return same;
+}
+
+// Name pending b after the block at addr, which it duplicates.  A
+// free buffer already cached under that name holds the same data and
+// is dropped; one that is in use keeps the name, and b its temporary
+// number.
+static void
+bnamedup(struct buf *b, block_t addr)
+{
+  struct buf *c;
+
+  acquire(&bcache.lock);
+  if ((c = bfind(b->dev, addr)) != 0 && c != b) {
+    acquire(BUFLOCK(c));
+    if (c->flags & (B_BUSY|B_DIRTY)) {
+      release(BUFLOCK(c));
+      release(&bcache.lock);
+      return;
+    }
+    bname(c, -1, 0);
+    c->flags = 0;
+    release(BUFLOCK(c));
+  }
+  bname(b, b->dev, addr);
+  release(&bcache.lock);
+}
+
+// Give b the address of an earlier copy of its data, if there is
+// one.  Returns the address, or 0 and sets *f to the entry b takes
+// once it has an address.
+static block_t
+segdedup(struct segwriter *seg, struct buf *b, struct fingerprint **f)
+{
+  struct fingerprint *e;
+  uint64 h;
+  int same;
+
+  *f = 0;
+  if (seg->dedup.size == 0 || b->inum == 0 || b->bn >= BN_INDIRECT || b->refs == 0)
+    return 0;
+  lfsstat.dedupchecked++;
+  h = bhash(b->data);
+  e = &seg->dedup.fp[(uint)h % seg->dedup.size];
+  if (e->addr != 0 && e->hash == h) {
+    // placed in this flush: the buffer is still there to compare
+    // with, unless it has been taken for a pack
+    if (e->gen == seg->dedup.gen)
+      same = e->b->block == e->addr && memcmp(e->b->data, b->data, BSIZE) == 0;
+    else
+      same = dedupsame(seg, e->addr, b->data);
+    if (same && sutshare(seg->dev, e->addr, b->refs)) {
+      lfsstat.deduphits++;
+      return e->addr;
+    }
+  }
+  e->hash = h;
+  e->addr = 0;
+  *f = e;
+  return 0;
+}
+
+// Forget indexed blocks in start..start+n-1 of dev, whose segment
+// is about to be cleaned.
+void
+bforget(uint dev, block_t start, uint n)
+{
+  struct segwriter *seg = segof(dev);
+  struct fingerprint *e;
+
+  acquire(&seg->lock);
+  while (seg->busy == 1)
+    sleep(seg, &seg->lock);
+  for (e = seg->dedup.fp; e < seg->dedup.fp + NDEDUP; e++)
+    if (PACKBLOCK(e->addr) >= start && PACKBLOCK(e->addr) < start + n)
+      e->addr = 0;
+  release(&seg->lock);
+}
+
+// Size every volume's fingerprint index to n entries, or turn
+// deduplication off with 0.  Returns the root's old size.
+int
+bdedup(uint n)
+{
+  struct segwriter *seg;
+  int old;
+
+  if (n > NDEDUP)
+    n = NDEDUP;
+  old = segs[0].dedup.size;
+  for (seg = segs; seg < segs + NMOUNT; seg++) {
+    acquire(&seg->lock);
+    while (seg->busy == 1)
+      sleep(seg, &seg->lock);
+    seg->dedup.size = n;
+    memset(seg->dedup.fp, 0, sizeof(seg->dedup.fp));
+    release(&seg->lock);
+  }
+  return old;
+}
+
+// Mark pending b as not needing a write of its own.  Another process
+// may be taking B_BUSY meanwhile, so this is done under its lock.
+static void
+bclean(struct buf *b)
+{
+  acquire(BUFLOCK(b));
+  b->flags &= ~B_DIRTY;
+  release(BUFLOCK(b));
+}
+
+// Compress b into seg->ztmp if it is worth packing.  Returns the
+// length, or -1.
+static int
+segzip(struct segwriter *seg, struct buf *b)
+{
+  int n;
+
+  if (b->inum == 0 || b->bn >= BN_INDIRECT || (b->flags & B_RAW))
+    return -1;
+  acquire(&zlock);
+  n = lzcompress(b->data, BSIZE, seg->ztmp, sizeof(((struct disk_pack *)0)->data) / 2);
+  if (n >= 0) {
+    lfsstat.zin += BSIZE;
+    lfsstat.zout += n;
+  }
+  release(&zlock);
+  return n;
+}
+
+// Sort the pending blocks of log head hi and give them their
+// addresses.  Packed blocks leave the list, which then holds what
+// is to be written.
+static void
+segplace(struct segwriter *seg, int hi)
+{
+  struct loghead *h = &seg->head[hi];
+  struct fingerprint *f;
+  struct buf *b, *pb;
+  struct disk_pack *p;
+  struct pack_entry *e;
+  uint i, j, t, slots;
+  int n;
+
+  for (i = 1; i < h->count; i++) {
+    b = h->blocks[i];
+    for (j = i; j > 0 && segbefore(b, h->blocks[j-1]); j--)
+      h->blocks[j] = h->blocks[j-1];
+    h->blocks[j] = b;
+  }
+  pb = 0;
+  p = 0;
+  j = 0;
+  slots = 0;
+  for (i = 0; i < h->count; i++) {
+    b = h->blocks[i];
+    t = (b->block - TEMPBASE) % NTRANS;
+    temps.trans[t].temp = b->block;
+    if ((temps.trans[t].final = segdedup(seg, b, &f)) != 0) {
+      // a second copy of a written block, counted by sutshare()
+      bnamedup(b, temps.trans[t].final);
+      bclean(b);
+      continue;
+    }
+    if ((n = segzip(seg, b)) >= 0) {
+      // j counts the entries of the open pack
+      if (pb == 0 || j == NPACK || p->entries[j-1].off + p->entries[j-1].len + n > sizeof(p->data)) {
+        pb = bnew(b->dev, 0);
+        memset(pb->data, 0, BSIZE);
+        pb->flags = B_BUSY | B_VALID;
+        pb->inum = 0;
+        pb->bn = BN_PACK;
+        acquire(&bcache.lock);
+        bname(pb, pb->dev, h->start + SEGMETABLOCKS + slots);
+        release(&bcache.lock);
+        h->blocks[slots++] = pb;
+        p = (struct disk_pack *)pb->data;
+        j = 0;
+      }
+      e = &p->entries[j];
+      e->inum = b->inum;
+      e->bn = b->bn;
+      e->off = j == 0 ? 0 : e[-1].off + e[-1].len;
+      e->len = n;
+      memmove(p->data + e->off, seg->ztmp, n);
+      temps.trans[t].final = PACKADDR(pb->block, j);
+      j++;
+      // the buffer stays cached as the expanded copy
+      bclean(b);
+    } else {
+      temps.trans[t].final = h->start + SEGMETABLOCKS + slots;
+      h->blocks[slots++] = b;
+    }
+    acquire(&bcache.lock);
+    bname(b, b->dev, temps.trans[t].final);
+    release(&bcache.lock);
+    sutlive(seg->dev, b->block, b->refs);
+    if (f) {
+      f->addr = b->block;
+      f->b = b;
+      f->gen = seg->dedup.gen;
+    }
+  }
+  h->count = slots;
+}
+
+// Replace temporary block numbers in pending inodes and the imap.
+static void
+segpatch(struct segwriter *seg, struct disk_superblock *sb)
+{
+  struct disk_inode *dip;
+  block_t *a;
+  struct buf *b;
+  uint h, i, k;
+
+  for (h = 0; h < NHEADS; h++) {
+    for (i = 0; i < seg->head[h].count; i++) {
+      b = seg->head[h].blocks[i];
+      if (b->bn == BN_INODE) {
+        dip = (struct disk_inode *)b->data;
+        for (k = 0; k < NADDRS; k++)
+          dip->addrs[k] = btrans(dip->addrs[k]);
+      } else if (b->bn == BN_IMAP) {
+        a = (block_t *)b->data;
+        for (k = 0; k < MAX_INODES; k++)
+          a[k] = btrans(a[k]);
+      }
+    }
+  }
+  sb->imap = btrans(sb->imap);
+  itrans();
+}
+
+// Write every log head with pending blocks.  The data head goes
+// before the metadata head, so inodes never reach the disk ahead of
+// the blocks they point to.  The checkpoint only moves when a segment
+// fills up; recovery rolls forward over the partial segments in
+// between.  Caller has set seg->busy.
+static void
+segwrite(struct segwriter *seg)
+{
+  struct disk_superblock *sb = getsb(seg->dev);
+  int h, last, full, i, n;
+
+  // fsync records written from here on are not in this flush
+  seg->cutgen = ilogcut(seg->dev, seg->ilgen);
+  seg->dedup.gen++;
+  for (h = 0; h < NHEADS; h++)
+    segplace(seg, h);
+  segpatch(seg, sb);
+  // a head may have nothing left to write after deduplication
+  for (last = 0; last < NHEADS && seg->head[last].count == 0; last++)
+    ;
+
+  // all heads' data goes to the disks at once, so heads whose
+  // segments sit on different disks of a stripe are written together
+  n = 0;
+  for (h = NHEADS; h-- > 0; )
+    n += segdata(seg, h, seg->io + n, seg->ioflags + n);
+  iderwv(seg->io, n);
+  // anyone who came for a block while it was on its way waits for this
+  for (i = 0; i < n; i++) {
+    acquire(BUFLOCK(seg->io[i]));
+    seg->io[i]->flags = seg->ioflags[i] & ~B_DIRTY;
+    wakeupq(&seg->io[i]->waiters);
+    release(BUFLOCK(seg->io[i]));
+  }
+
+  full = 0;
+  for (h = NHEADS; h-- > 0; )
+    if (seg->head[h].count > 0)
+      full |= segwritehead(seg, h, h == last);
+  // packs are only the writer's until they are on disk
+  for (i = 0; i < n; i++)
+    if (seg->io[i]->bn == BN_PACK)
+      brelse(seg->io[i]);
+
+  seg->imap = sb->imap;
+  seg->ninodes = sb->ninodes;
+  sb->ilgen = seg->ilgen = seg->cutgen;
+  if (full)
+    checkpoint(seg, sb);
+}
+
+// Write out everything pending on dev and checkpoint it.
+void
+bcheckpoint(uint dev)
+{
+  struct segwriter *seg = segof(dev);
+
+  acquire(&seg->lock);
+  while (seg->busy == 1)
+    sleep(seg, &seg->lock);
+  seg->busy = 1;
+  release(&seg->lock);
+  segwrite(seg);
+  checkpoint(seg, getsb(dev));
+  acquire(&seg->lock);
+  seg->busy = 0;
+  wakeup(seg);
+  release(&seg->lock);
+}
+
+// The imap and inode count of dev as of the last flush, all of
+// whose blocks are on disk.
+block_t
+bstable(uint dev, uint *ninodes)
+{
+  struct segwriter *seg = segof(dev);
+  block_t imap;
+
+  acquire(&seg->lock);
+  while (seg->busy == 1)
+    sleep(seg, &seg->lock);
+  imap = seg->imap;
+  *ninodes = seg->ninodes;
+  release(&seg->lock);
+  return imap;
+}
+
+// Copy the summary at start into sum.  Returns 1 if it is one.
+int
+segsummary(uint dev, block_t start, struct seg_summary *sum)
+{
+  struct buf *bp;
+  uint crc;
+
+  bp = bread(dev, start);
+  memmove(sum, bp->data, sizeof(*sum));
+  brelse(bp);
+
+  crc = sum->sumcrc;
+  sum->sumcrc = 0;
+  if (sum->magic != SUMMAGIC || crc32c(0, sum, sizeof(*sum)) != crc ||
+      sum->nblocks > PARTBLOCKS)
+    return 0;
+  sum->sumcrc = crc;
+  return 1;
+}
+
+// Does a valid summary with the given serial sit at start?
+static int
+segcheck(uint dev, block_t start, uint serial, struct seg_summary *sum)
+{
+  struct buf *bp;
+  uint k, crc;
+
+  if (!segsummary(dev, start, sum) || sum->serial != serial)
+    return 0;
+
+  crc = 0;
+  for (k = 0; k < sum->nblocks; k++) {
+    bp = bread(dev, start + SEGMETABLOCKS + k);
+    crc = crc32c(crc, bp->data, BSIZE);
+    brelse(bp);
+  }
+  return crc == sum->datacrc;
+}
+
+// Roll a freshly read superblock of dev forward over the partial
+// segments written since its checkpoint, and start dev's segment
+// writer from it.
+void
+segrecover(uint dev, struct disk_superblock *sb)
+{
+  struct seg_summary *sum;
+  struct segwriter *seg = segof(dev);
+  int h, n;
+
+  // a mount may recover one volume while boot recovers another
+  if ((sum = (struct seg_summary *)kalloc()) == 0)
+    panic("segrecover: out of memory");
+  seg->dev = dev;
+  for (n = 0; ; n++) {
+    for (h = 0; h < NHEADS; h++)
+      if (segcheck(dev, sb->head[h], sb->serial + 1, sum))
+        break;
+    if (h == NHEADS)
+      break;
+    segadvance(sb, h, sb->head[h], sum);
+    sb->imap = sum->imap;
+    sb->ninodes = sum->ninodes;
+    sb->ilgen = sum->ilgen;
+  }
+  kfree((char *)sum);
+  seg->imap = sb->imap;
+  seg->ninodes = sb->ninodes;
+  seg->ilgen = sb->ilgen;
+  if (n > 0) {
+    cprintf("bio: rolled forward %d partial segments\n", n);
+    // the cleaner reuses segments the old checkpoint still needs
+    checkpoint(seg, sb);
+  }
+}
+
+// Release the buffer b.
+void
+brelse(struct buf *b)
+{
+  if((b->flags & B_BUSY) == 0)
+    panic("brelse");
+
+  waitseg(b->dev);
+  // in never moves, so it needs no bcache.lock
+  if(b->q == Q_MAIN){
+    acquire(&bcache.lock);
+    btouch(b);
+    release(&bcache.lock);
+  }
+  bunlock(b);
 }
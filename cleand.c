@@ -0,0 +1,100 @@
+// User-level segment cleaner.  Takes over from the kernel's cleaner
+// thread and cleans the emptiest segments whenever fewer than
+// LOW are clean.  "cleand once" makes a single pass and exits.
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "fs.h"
+
+#define LOW 8
+#define HIGH 10
+
+struct seg_usage use[MAXSEGS];
+struct seg_summary sum;
+struct blk_info bi[PARTBLOCKS];
+uint segblocks;
+
+// Move the live blocks of segment s and mark it clean.
+int
+clean(int s)
+{
+  block_t start;
+  uint k, serial;
+  int n;
+
+  serial = 0;
+  for(start = SEG2B(s); lfssum(start, &sum) == 0 && sum.serial > serial; start = sum.next){
+    serial = sum.serial;
+    for(k = 0; k < sum.nblocks; k++){
+      bi[k].inum = sum.entries[k].inum;
+      bi[k].bn = sum.entries[k].bn;
+      bi[k].addr = start + SEGMETABLOCKS + k;
+    }
+    if(lfsbmapv(bi, sum.nblocks) < 0)
+      return -1;
+    // only the live ones need moving
+    for(n = k = 0; k < sum.nblocks; k++)
+      if(bi[k].live)
+        bi[n++] = bi[k];
+    if(lfsmarkv(bi, n) != 0)
+      return -1;
+    if(B2SEG(sum.next) != s)
+      break;
+  }
+  return lfssegclean(s);
+}
+
+// Greedy: the segment with the fewest live blocks.
+int
+victim(int nsegs)
+{
+  int s, v;
+
+  v = -1;
+  for(s = 0; s < nsegs; s++){
+    if(use[s].flags & (SEG_CLEAN|SEG_ACTIVE|SEG_STUCK|SEG_VICTIM))
+      continue;
+    if(use[s].live < SEGDATABLOCKS && (v < 0 || use[s].live < use[v].live))
+      v = s;
+  }
+  return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct lfsstat st;
+  int s, nsegs, nclean, once;
+
+  once = argc > 1 && strcmp(argv[1], "once") == 0;
+  if(lfsstat(&st) < 0){
+    printf(2, "cleand: no log-structured file system\n");
+    exit();
+  }
+  segblocks = st.segblocks;
+  lfscleaner(0);
+  for(;;){
+    nsegs = lfssegs(use, MAXSEGS);
+    for(nclean = s = 0; s < nsegs; s++)
+      if(use[s].flags & SEG_CLEAN)
+        nclean++;
+    if(nclean < LOW || once){
+      while(nclean < HIGH && (s = victim(nsegs)) >= 0){
+        if(clean(s) < 0){
+          printf(2, "cleand: segment %d is stuck\n", s);
+          use[s].flags |= SEG_STUCK;
+          continue;
+        }
+        printf(1, "cleand: cleaned segment %d (%d live)\n", s, use[s].live);
+        use[s].flags |= SEG_CLEAN;
+        nclean++;
+      }
+    }
+    if(once)
+      break;
+    sleep(100);
+  }
+  lfscleaner(1);
+  exit();
+}
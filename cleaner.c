@@ -0,0 +1,809 @@
+// Segment cleaner.
+//
+// The log only ever appends, so space comes back by picking
+// segments that are mostly dead, copying their live blocks to the
+// head of the log and handing the emptied segments to the log heads
+// again.
+//
+// The segment usage table records, for every segment, how many of
+// its blocks are live and the serial of the last write into it.  It
+// is not kept on disk: sutinit() rebuilds it at mount from the imap,
+// and bwrite() keeps it current by counting each block it places as
+// live and the block that copy replaces as dead.
+//
+// Two victim policies, picked with mkfs -c and kept in the superblock:
+// * greedy: fewest live blocks first.
+// * cost-benefit (Sprite LFS): highest (1-u)*age/(1+u), where u is
+//   the live fraction and age is the number of summaries written
+//   since the segment was last written.  Cold segments get cleaned
+//   at higher utilization than hot ones.
+// Live blocks from a batch of victims are rewritten oldest first, so
+// blocks of a similar age end up sharing segments.  A block can be
+// shared by cloned files, so liveness comes from scanning every
+// inode for references into the victims rather than from the owner
+// the summary names, and all references to a block move to one copy.
+// Live counts are reference counts, and a block in a pack counts
+// as much as one that is not.
+//
+// Cleaning normally happens in a kernel thread that wakes on the
+// timer and, while the disk is idle, cleans a few segments at a time
+// until CLEANLOW are clean.  Writers only clean in the foreground
+// once the log is down to CLEANFLOOR.
+//
+// Every mounted volume has a usage table of its own.  The thread
+// and foreground cleaning go through all of them, cleaning one
+// volume at a time.  The user-level cleaner interface and snapshots
+// are the root's.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "fs.h"
+
+#define CLEANFLOOR (NHEADS + 2) // writers clean below this many clean segments
+#define CLEANLOW  (NHEADS + 6)  // the cleaner thread works below this many
+#define CLEANSTEP 2             // segments the thread cleans per wakeup
+#define CLEANIDLE 10            // ticks without disk requests that count as idle
+#define CLEANBATCH 2            // victims whose live blocks are sorted together
+#define MAXAGE (1 << 20)
+
+// The usage table of one mounted volume, in the slot lfsvol()
+// gives its device.
+struct segtable {
+  struct spinlock lock;
+  uint dev;
+  uint policy;
+  uint nsegs; // 0 until sutinit
+  uint nclean;
+  struct seg_usage use[MAXSEGS];
+};
+
+static struct segtable suts[NMOUNT];
+
+// One volume is cleaned, or has a snapshot taken or dropped, at a
+// time, and has the space below to itself.
+struct {
+  struct spinlock lock;
+  int cleaning;
+  int background;  // does the cleaner thread run?
+} clean;
+
+struct lfsstat lfsstat;
+
+// references into the victims being cleaned, guarded by clean.cleaning
+static struct liveblock {
+  uint serial;
+  ushort inum;
+  ushort bn;
+  block_t addr;
+  block_t to; // where the first reference's copy went
+} live[2 * CLEANBATCH * MAXSEGBLOCKS];
+static struct seg_summary sum;
+// serial of the summary each victim block was written under
+static uint bserial[CLEANBATCH][MAXSEGBLOCKS];
+
+// The usage table of dev, or 0 if it is not mounted.
+static struct segtable*
+sutof(uint dev)
+{
+  int v;
+
+  if ((v = lfsvol(dev)) < 0)
+    return 0;
+  return &suts[v];
+}
+
+// Count delta more references to block b of dev.  unstick lets the
+// cleaner try b's segment again if one went away.
+static void
+sutcount(uint dev, block_t b, int delta, int unstick)
+{
+  struct segtable *sut = sutof(dev);
+  struct seg_usage *u;
+
+  b = PACKBLOCK(b);
+  if (b < SEGSTART || B2SEG(b) >= sut->nsegs)
+    return;
+  acquire(&sut->lock);
+  u = &sut->use[B2SEG(b)];
+  if (delta > 0 || u->live > 0)
+    u->live += delta;
+  if (delta < 0 && unstick)
+    u->flags &= ~SEG_STUCK;
+  release(&sut->lock);
+}
+
+// Block b of dev has become live (delta 1) or dead (delta -1).  A
+// segment stuck on a shared or busy block may clean once it dies.
+void
+sutlive(uint dev, block_t b, int delta)
+{
+  sutcount(dev, b, delta, 1);
+}
+
+// Add n references to block b for a copy of it that is being
+// written, unless its segment is clean or being cleaned.  Returns 1
+// if it did.
+int
+sutshare(uint dev, block_t b, int n)
+{
+  struct segtable *sut = sutof(dev);
+  struct seg_usage *u;
+  int ok;
+
+  b = PACKBLOCK(b);
+  if (b < SEGSTART || B2SEG(b) >= sut->nsegs)
+    return 0;
+  acquire(&sut->lock);
+  u = &sut->use[B2SEG(b)];
+  ok = (u->flags & (SEG_CLEAN|SEG_VICTIM)) == 0;
+  if (ok)
+    u->live += n;
+  release(&sut->lock);
+  return ok;
+}
+
+// A partial segment with the given serial was written at start.
+void
+sutwritten(uint dev, block_t start, uint serial)
+{
+  struct segtable *sut = sutof(dev);
+
+  acquire(&sut->lock);
+  sut->use[B2SEG(start)].age = serial;
+  release(&sut->lock);
+}
+
+// Give a clean segment to a log head that is leaving segment old:
+// the nearest one, looking both ways and wrapping around the disk,
+// to keep the head from seeking far.
+uint
+segalloc(uint dev, uint old)
+{
+  struct segtable *sut = sutof(dev);
+  uint d, s;
+
+  acquire(&sut->lock);
+  for (d = 1; d <= sut->nsegs; d++) {
+    s = (old + d) % sut->nsegs;
+    if (sut->use[s].flags & SEG_CLEAN)
+      break;
+    s = (old + sut->nsegs - d) % sut->nsegs;
+    if (sut->use[s].flags & SEG_CLEAN)
+      break;
+  }
+  if (d > sut->nsegs)
+    panic("segalloc: out of segments");
+  sut->use[s].flags = SEG_ACTIVE;
+  sut->use[s].live = 0;
+  sut->nclean--;
+  sut->use[old].flags &= ~SEG_ACTIVE;
+  release(&sut->lock);
+  return s;
+}
+
+// segments only a snapshot being dropped held blocks in, guarded by
+// clean.cleaning
+static uchar unpinned[MAXSEGS];
+
+// Count block b of dev as sutlive() does, but leave the segment
+// stuck.  Dropping a snapshot (delta -1) marks b's segment unpinned
+// instead; a walk of a snapshot that stays (delta 0) only marks it
+// pinned again.
+static void
+walkblock(uint dev, block_t b, int delta)
+{
+  struct segtable *sut = sutof(dev);
+
+  if (delta != 0)
+    sutcount(dev, b, delta, 0);
+  b = PACKBLOCK(b);
+  if (delta <= 0 && b >= SEGSTART && B2SEG(b) < sut->nsegs)
+    unpinned[B2SEG(b)] = delta < 0;
+}
+
+// Count every block of dev reachable from imap as live (delta 1) or
+// no longer held by it (delta -1), or with delta 0 only find the
+// segments it reaches.
+static void
+sutwalk(uint dev, block_t imap, uint ninodes, int delta)
+{
+  struct buf *bp, *ib;
+  struct disk_inode *dip;
+  block_t b;
+  uint inum, k;
+
+  walkblock(dev, imap, delta);
+  for (inum = 1; inum < ninodes && inum < MAX_INODES; inum++) {
+    bp = bread(dev, imap);
+    b = ((block_t *)bp->data)[inum];
+    brelse(bp);
+    if (b == 0)
+      continue;
+    walkblock(dev, b, delta);
+    bp = bread(dev, b);
+    dip = (struct disk_inode *)bp->data;
+    if (dip->type != 0) {
+      for (k = 0; k < NADDRS; k++)
+        walkblock(dev, dip->addrs[k], delta);
+      if (dip->addrs[NDIRECT] != 0) {
+        ib = bread(dev, dip->addrs[NDIRECT]);
+        for (k = 0; k < NINDIRECT; k++)
+          walkblock(dev, ((block_t *)ib->data)[k], delta);
+        brelse(ib);
+      }
+    }
+    brelse(bp);
+  }
+}
+
+// Keep the cleaner, and other holders, out while segments are
+// being cleaned or snapshots taken or dropped.
+static void
+cleanlock(void)
+{
+  acquire(&clean.lock);
+  while (clean.cleaning)
+    sleep(&clean, &clean.lock);
+  clean.cleaning = 1;
+  release(&clean.lock);
+}
+
+static void
+cleanunlock(void)
+{
+  acquire(&clean.lock);
+  clean.cleaning = 0;
+  wakeup(&clean);
+  release(&clean.lock);
+}
+
+// Segments that fit on the disk, or 0 if the disk did not say.
+static uint
+disksegs(uint dev)
+{
+  uint sectors = idesize(dev);
+
+  // block b ends at sector b*SPB
+  if (sectors == 0 || (sectors - 1) / SPB < SEGSTART)
+    return 0;
+  return ((sectors - 1) / SPB - SEGSTART + 1) / SEGBLOCKS;
+}
+
+// Segments of dev, striped over dev2 if it is not 0.
+static uint
+stripesegs(uint dev, uint dev2)
+{
+  uint a = disksegs(dev), b;
+
+  if (dev2 == 0 || a == 0)
+    return a;
+  if ((b = disksegs(dev2)) == 0)
+    return 0;
+  // even segments on dev, odd ones on dev2
+  return 2 * a < 2 * b + 1 ? 2 * a : 2 * b + 1;
+}
+
+// Rebuild the usage table for the file system on dev that sb
+// describes: every block reachable from the imap or a snapshot is
+// live, the log heads' segments are active and anything else is
+// clean.  The log uses the whole disk, however much of it mkfs wrote.
+void
+sutinit(uint dev, struct disk_superblock *sb)
+{
+  struct segtable *sut = sutof(dev);
+  block_t start;
+  uint s, k, serial;
+
+  cleanlock();
+  sut->dev = dev;
+  if ((s = stripesegs(dev, sb->stripe)) != 0)
+    sb->nsegs = s;
+  sut->nsegs = sb->nsegs < MAXSEGS ? sb->nsegs : MAXSEGS;
+  sut->policy = sb->policy;
+  for (s = 0; s < sut->nsegs; s++) {
+    sut->use[s].live = sut->use[s].age = 0;
+    sut->use[s].flags = 0;
+  }
+
+  sutwalk(dev, sb->imap, sb->ninodes, 1);
+  for (k = 0; k < NSNAP; k++)
+    if (sb->snap[k].imap != 0)
+      sutwalk(dev, sb->snap[k].imap, sb->snap[k].ninodes, 1);
+
+  for (k = 0; k < NHEADS; k++)
+    sut->use[B2SEG(sb->head[k])].flags |= SEG_ACTIVE;
+
+  sut->nclean = 0;
+  for (s = 0; s < sut->nsegs; s++) {
+    if (sut->use[s].live == 0 && !(sut->use[s].flags & SEG_ACTIVE)) {
+      sut->use[s].flags = SEG_CLEAN;
+      sut->nclean++;
+      continue;
+    }
+    // age is the serial of the last partial segment in the chain
+    serial = 0;
+    for (start = SEG2B(s); segsummary(dev, start, &sum) && sum.serial > serial; start = sum.next) {
+      serial = sum.serial;
+      if (B2SEG(sum.next) != s)
+        break;
+    }
+    sut->use[s].age = serial;
+  }
+  cleanunlock();
+}
+
+// Pick the next victim, or -1 if no segment is worth cleaning.
+// Only segments whose live blocks fit in budget are considered.
+static int
+victim(struct segtable *sut, uint budget)
+{
+  struct seg_usage *u;
+  uint s, age, score, best;
+  int v;
+
+  v = -1;
+  best = 0;
+  for (s = 0; s < sut->nsegs; s++) {
+    u = &sut->use[s];
+    if ((u->flags & (SEG_CLEAN|SEG_ACTIVE|SEG_STUCK|SEG_VICTIM)) != 0 ||
+        u->live >= SEGDATABLOCKS || u->live > budget)
+      continue;
+    if (sut->policy == CLEAN_COSTBENEFIT) {
+      age = getsb(sut->dev)->serial - u->age + 1;
+      if (age > MAXAGE)
+        age = MAXAGE;
+      score = (SEGDATABLOCKS - u->live) * age / (SEGDATABLOCKS + u->live);
+    } else
+      score = SEGDATABLOCKS - u->live;
+    if (score > best) {
+      best = score;
+      v = s;
+    }
+  }
+  return v;
+}
+
+// Note when each block of victim i, segment s of dev, was written.
+static void
+ages(uint dev, int i, uint s)
+{
+  block_t start;
+  uint k, serial;
+
+  memset(bserial[i], 0, sizeof(bserial[i]));
+  serial = 0;
+  for (start = SEG2B(s); segsummary(dev, start, &sum) && sum.serial > serial; start = sum.next) {
+    serial = sum.serial;
+    for (k = 0; k < sum.nblocks; k++)
+      bserial[i][start - SEG2B(s) + SEGMETABLOCKS + k] = serial;
+    if (B2SEG(sum.next) != s)
+      break;
+  }
+}
+
+// Which of the nv victims in v holds block b, or -1.
+static int
+vindex(block_t b, uint *v, int nv)
+{
+  int i;
+
+  b = PACKBLOCK(b);
+  for (i = 0; i < nv; i++)
+    if (b >= SEG2B(v[i]) && b < SEG2B(v[i] + 1))
+      return i;
+  return -1;
+}
+
+// Add the reference to addr as block bn of inode inum to live[n...]
+// if it points into a victim.  -1 means live[] is full.
+static int
+addref(uint *v, int nv, int n, uint inum, uint bn, block_t addr)
+{
+  int i;
+
+  if (n < 0 || (i = vindex(addr, v, nv)) < 0)
+    return n;
+  if (n == NELEM(live))
+    return -1;
+  live[n].serial = bserial[i][PACKBLOCK(addr) - SEG2B(v[i])];
+  live[n].inum = inum;
+  live[n].bn = bn;
+  live[n].addr = addr;
+  return n + 1;
+}
+
+// Put every reference into the victims from the file system on dev
+// rooted at imap into live[]: the imap itself, inodes, data and
+// indirect blocks.  Returns how many, or -1 if they do not fit.
+static int
+gather(uint dev, block_t imap, uint ninodes, uint *v, int nv)
+{
+  struct buf *bp, *ib;
+  struct disk_inode *dip;
+  block_t b;
+  uint inum, k;
+  int n;
+
+  n = addref(v, nv, 0, 0, BN_IMAP, imap);
+  for (inum = 1; inum < ninodes && inum < MAX_INODES; inum++) {
+    bp = bread(dev, imap);
+    b = ((block_t *)bp->data)[inum];
+    brelse(bp);
+    if (b == 0)
+      continue;
+    n = addref(v, nv, n, inum, BN_INODE, b);
+    bp = bread(dev, b);
+    dip = (struct disk_inode *)bp->data;
+    if (dip->type != 0) {
+      for (k = 0; k < NADDRS; k++)
+        n = addref(v, nv, n, inum, k < NDIRECT ? k : BN_INDIRECT, dip->addrs[k]);
+      if (dip->addrs[NDIRECT] != 0) {
+        ib = bread(dev, dip->addrs[NDIRECT]);
+        for (k = 0; k < NINDIRECT; k++)
+          n = addref(v, nv, n, inum, NDIRECT + k, ((block_t *)ib->data)[k]);
+        brelse(ib);
+      }
+    }
+    brelse(bp);
+  }
+  return n;
+}
+
+// Oldest first, with references to the same block together.
+static void
+agesort(int n)
+{
+  struct liveblock t;
+  int i, j;
+
+  for (i = 1; i < n; i++) {
+    t = live[i];
+    for (j = i; j > 0 && (live[j-1].serial > t.serial ||
+         (live[j-1].serial == t.serial && live[j-1].addr > t.addr)); j--)
+      live[j] = live[j-1];
+    live[j] = t;
+  }
+}
+
+// Is live[i] a second or later reference to a block?
+#define SHARED(i) ((i) > 0 && live[i].addr == live[(i)-1].addr)
+
+// Move the references in live[0..n-1].  The first reference to each
+// block gets a copy and the others follow it there.  Victims whose
+// blocks cannot move are marked in stuck[].
+static void
+relog(uint dev, int n, uint *v, int nv, int *stuck)
+{
+  struct liveblock *l;
+  block_t to;
+  int i, k, vi;
+
+  for (i = 0; i < n; i++) {
+    l = &live[i];
+    l->to = 0;
+    // the next copies' reads queue behind this one
+    for (k = i + 1; k <= i + NREADAHEAD && k < n; k++)
+      bprefetch(dev, live[k].addr);
+    vi = vindex(l->addr, v, nv);
+    if (stuck[vi] || SHARED(i))
+      continue;
+    if (irelog(dev, l->inum, l->bn, l->addr, &l->to) < 0)
+      stuck[vi] = 1;
+  }
+
+  // the copies must have addresses before they are shared
+  bsync(dev);
+  to = 0;
+  for (i = 0; i < n; i++) {
+    l = &live[i];
+    vi = vindex(l->addr, v, nv);
+    if (!SHARED(i)) {
+      to = btrans(l->to);
+      continue;
+    }
+    if (stuck[vi])
+      continue;
+    if (to == 0) {
+      // the first reference was rewritten since the scan
+      if (irelog(dev, l->inum, l->bn, l->addr, &to) < 0)
+        stuck[vi] = 1;
+      bsync(dev);
+      to = btrans(to);
+      continue;
+    }
+    iremap(dev, l->inum, l->bn, l->addr, to);
+  }
+}
+
+// Clean dev until want segments are clean or nothing is worth
+// cleaning.  Returns the number of segments reclaimed.
+int
+segclean(uint dev, uint want)
+{
+  struct disk_superblock *sb = getsb(dev);
+  struct segtable *sut = sutof(dev);
+  uint v[CLEANBATCH], budget;
+  int i, k, n, nv, nlive, reclaimed, stuck[CLEANBATCH];
+
+  cleanlock();
+  acquire(&sut->lock);
+  reclaimed = 0;
+  while (sut->nclean < want) {
+    // copies need room: keep a clean segment per log head in hand
+    budget = sut->nclean > NHEADS ? (sut->nclean - NHEADS) * SEGDATABLOCKS : 0;
+    for (nv = 0; nv < CLEANBATCH && (n = victim(sut, budget)) >= 0; nv++) {
+      v[nv] = n;
+      sut->use[n].flags |= SEG_VICTIM;
+      budget -= sut->use[n].live;
+    }
+    if (nv == 0)
+      break;
+    release(&sut->lock);
+
+    for (i = 0; i < nv; i++) {
+      ages(dev, i, v[i]);
+      stuck[i] = 0;
+    }
+    // blocks a snapshot holds never move
+    for (k = 0; k < NSNAP; k++) {
+      if (sb->snap[k].imap == 0)
+        continue;
+      n = gather(dev, sb->snap[k].imap, sb->snap[k].ninodes, v, nv);
+      for (i = 0; i < nv; i++)
+        if (n < 0)
+          stuck[i] = 1;
+      for (i = 0; i < n; i++)
+        stuck[vindex(live[i].addr, v, nv)] = 1;
+    }
+    nlive = gather(dev, sb->imap, sb->ninodes, v, nv);
+    if (nlive < 0) {
+      for (i = 0; i < nv; i++)
+        stuck[i] = 1;
+      nlive = 0;
+    }
+    agesort(nlive);
+    relog(dev, nlive, v, nv, stuck);
+
+    // the copies and a checkpoint that no longer refers to the
+    // victims must be on disk before the victims are reused
+    bcheckpoint(dev);
+    for (i = 0; i < nv; i++)
+      if (!stuck[i])
+        bforget(dev, SEG2B(v[i]), SEGBLOCKS);
+
+    acquire(&sut->lock);
+    for (i = 0; i < nv; i++) {
+      sut->use[v[i]].flags &= ~SEG_VICTIM;
+      if (stuck[i]) {
+        sut->use[v[i]].flags |= SEG_STUCK;
+        continue;
+      }
+      binval(dev, SEG2B(v[i]), SEGBLOCKS);
+      sut->use[v[i]].flags = SEG_CLEAN;
+      sut->use[v[i]].live = 0;
+      sut->nclean++;
+      reclaimed++;
+      lfsstat.cleaned++;
+    }
+    lfsstat.moved += nlive;
+  }
+
+  release(&sut->lock);
+  cleanunlock();
+  return reclaimed;
+}
+
+// Pin the file system as of the last flush in a free snapshot slot.
+// Returns the slot, or -1 if there is none.
+int
+snapcreate(void)
+{
+  struct disk_superblock *sb = getsb(ROOTDEV);
+  struct disk_snapshot *sp;
+  int k;
+
+  // with the cleaner out, nothing the checkpoint holds can move
+  // before it is counted
+  cleanlock();
+  for (k = 0; k < NSNAP && sb->snap[k].imap != 0; k++)
+    ;
+  if (k == NSNAP) {
+    cleanunlock();
+    return -1;
+  }
+  bcheckpoint(ROOTDEV);
+  sp = &sb->snap[k];
+  sp->imap = bstable(ROOTDEV, &sp->ninodes);
+  sp->serial = sb->serial;
+  sutwalk(ROOTDEV, sp->imap, sp->ninodes, 1);
+  cleanunlock();
+  bcheckpoint(ROOTDEV);
+  return k;
+}
+
+// Drop snapshot k, unless a file in it is open.
+int
+snapdelete(int k)
+{
+  struct disk_superblock *sb = getsb(ROOTDEV);
+  struct segtable *sut = sutof(ROOTDEV);
+  struct disk_snapshot *sp;
+  block_t imap;
+  uint s;
+  int j;
+
+  if (k < 0 || k >= NSNAP)
+    return -1;
+  cleanlock();
+  sp = &sb->snap[k];
+  imap = sp->imap;
+  // snapopen() cannot take a file in it once the slot is empty
+  if (imap == 0 || isnapdrop(k + 1) < 0) {
+    cleanunlock();
+    return -1;
+  }
+  memset(unpinned, 0, sizeof(unpinned));
+  sutwalk(ROOTDEV, imap, sp->ninodes, -1);
+  for (j = 0; j < NSNAP; j++)
+    if (sb->snap[j].imap != 0)
+      sutwalk(ROOTDEV, sb->snap[j].imap, sb->snap[j].ninodes, 0);
+  // segments only it made stuck may be cleanable now; ones another
+  // snapshot still pins are left alone
+  acquire(&sut->lock);
+  for (s = 0; s < sut->nsegs; s++)
+    if (unpinned[s])
+      sut->use[s].flags &= ~SEG_STUCK;
+  release(&sut->lock);
+  cleanunlock();
+  bcheckpoint(ROOTDEV);
+  return 0;
+}
+
+// Mark segment s clean on behalf of a user-level cleaner, which has
+// moved its live blocks with lfsmarkv().  Fails if any are left.
+int
+segmarkclean(uint s)
+{
+  struct segtable *sut = sutof(ROOTDEV);
+  struct seg_usage *u;
+  int r;
+
+  if (s >= sut->nsegs)
+    return -1;
+  cleanlock();
+  // the moves must be durable before the segment is reused
+  bcheckpoint(ROOTDEV);
+  bforget(ROOTDEV, SEG2B(s), SEGBLOCKS);
+
+  acquire(&sut->lock);
+  u = &sut->use[s];
+  r = 0;
+  if (u->flags & SEG_CLEAN)
+    ;
+  else if (u->live != 0 || (u->flags & (SEG_ACTIVE|SEG_VICTIM)) != 0)
+    r = -1;
+  else {
+    binval(ROOTDEV, SEG2B(s), SEGBLOCKS);
+    u->flags = SEG_CLEAN;
+    sut->nclean++;
+    lfsstat.cleaned++;
+  }
+  release(&sut->lock);
+  cleanunlock();
+  return r;
+}
+
+// Copy out up to n of the root's usage table entries.  Returns how
+// many.
+int
+segusage(struct seg_usage *u, int n)
+{
+  struct segtable *sut = sutof(ROOTDEV);
+
+  acquire(&sut->lock);
+  if (n > sut->nsegs)
+    n = sut->nsegs;
+  memmove(u, sut->use, n * sizeof(*u));
+  release(&sut->lock);
+  return n;
+}
+
+// Turn the cleaner thread on or off, for a user-level cleaner
+// taking over.  Foreground cleaning still runs at CLEANFLOOR.
+// Returns the old setting.
+int
+cleanerctl(int on)
+{
+  int old;
+
+  acquire(&clean.lock);
+  old = clean.background;
+  clean.background = on != 0;
+  release(&clean.lock);
+  return old;
+}
+
+// Pick the victim policy, CLEAN_GREEDY or CLEAN_COSTBENEFIT, of
+// every mounted volume; volumes mounted later start from the one
+// mkfs wrote.  Returns the root volume's old policy.
+int
+cleanpolicy(uint policy)
+{
+  struct segtable *sut;
+  int old;
+
+  old = sutof(ROOTDEV)->policy;
+  for (sut = suts; sut < suts + NMOUNT; sut++) {
+    acquire(&sut->lock);
+    sut->policy = policy;
+    release(&sut->lock);
+  }
+  return old;
+}
+
+// Writers call this before they lock any inodes, and clean in the
+// foreground if the cleaner thread has fallen behind on a volume.
+void
+cleanreserve(void)
+{
+  struct segtable *sut;
+
+  for (sut = suts; sut < suts + NMOUNT; sut++)
+    if (sut->nsegs > 0 && sut->nclean < CLEANFLOOR)
+      segclean(sut->dev, CLEANFLOOR);
+}
+
+static void
+cleaner(void)
+{
+  struct segtable *sut;
+  uint want;
+
+  for (;;) {
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    // sutinit runs on the first file system access, or at mount
+    for (sut = suts; sut < suts + NMOUNT; sut++) {
+      if (!clean.background || sut->nsegs == 0 || sut->nclean >= CLEANLOW ||
+          !ideidle(CLEANIDLE))
+        continue;
+      want = sut->nclean + CLEANSTEP;
+      if (want > CLEANLOW)
+        want = CLEANLOW;
+      segclean(sut->dev, want);
+    }
+  }
+}
+
+void
+cleanerinit(void)
+{
+  struct segtable *sut;
+
+  initlock(&clean.lock, "clean");
+  for (sut = suts; sut < suts + NMOUNT; sut++)
+    initlock(&sut->lock, "sut");
+  clean.background = 1;
+  kproc("cleaner", cleaner);
+}
+
+// Fill in st with the current counters, and the root's table.
+void
+segstat(struct lfsstat *st)
+{
+  struct segtable *sut = sutof(ROOTDEV);
+
+  acquire(&sut->lock);
+  *st = lfsstat;
+  st->nsegs = sut->nsegs;
+  st->nclean = sut->nclean;
+  st->policy = sut->policy;
+  st->bsize = BSIZE;
+  st->segblocks = SEGBLOCKS;
+  release(&sut->lock);
+}
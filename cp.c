@@ -0,0 +1,37 @@
+// Copy a file.  The copy shares the original's blocks (reflink)
+// when it can; otherwise the data is read and written out.
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+char buf[512];
+
+int
+main(int argc, char *argv[])
+{
+  int fd0, fd1, n;
+
+  if(argc != 3){
+    printf(2, "Usage: cp src dst\n");
+    exit();
+  }
+  if(reflink(argv[1], argv[2]) == 0)
+    exit();
+  if((fd0 = open(argv[1], O_RDONLY)) < 0){
+    printf(2, "cp: cannot open %s\n", argv[1]);
+    exit();
+  }
+  if((fd1 = open(argv[2], O_CREATE|O_WRONLY)) < 0){
+    printf(2, "cp: cannot create %s\n", argv[2]);
+    exit();
+  }
+  while((n = read(fd0, buf, sizeof(buf))) > 0)
+    if(write(fd1, buf, n) != n){
+      printf(2, "cp: write error\n");
+      break;
+    }
+  close(fd0);
+  close(fd1);
+  exit();
+}
@@ -0,0 +1,94 @@
+// CRC32C (Castagnoli) checksums for segment summaries.
+//
+// Uses the SSE4.2 crc32 instruction when cpuid says it is there
+// and falls back to slice-by-8 tables otherwise.  Depends on
+// nothing but types.h, so mkfs and user programs link it too.
+
+#include "types.h"
+
+#define POLY 0x82f63b78  // reflected Castagnoli polynomial
+
+static uint table[8][256];
+static int ready;
+static int hashw;   // cpu has the crc32 instruction
+static int usehw;   // crc32c() should use it
+
+static void
+cpuid(uint leaf, uint *a, uint *b, uint *c, uint *d)
+{
+  asm volatile("cpuid" : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d) : "a" (leaf));
+}
+
+static void
+crcinit(void)
+{
+  uint i, j, c, a, b, d;
+
+  for(i = 0; i < 256; i++){
+    c = i;
+    for(j = 0; j < 8; j++)
+      c = (c >> 1) ^ (POLY & -(c & 1));
+    table[0][i] = c;
+  }
+  for(i = 0; i < 256; i++)
+    for(j = 1; j < 8; j++)
+      table[j][i] = (table[j-1][i] >> 8) ^ table[0][table[j-1][i] & 0xff];
+
+  cpuid(1, &a, &b, &c, &d);
+  hashw = usehw = (c >> 20) & 1;
+  ready = 1;
+}
+
+// Slice-by-8: fold eight bytes per step through eight tables.
+static uint
+crcsw(uint crc, const uchar *p, uint n)
+{
+  uint a, b;
+
+  for(; n >= 8; n -= 8, p += 8){
+    a = *(uint*)p ^ crc;
+    b = *(uint*)(p + 4);
+    crc = table[7][a & 0xff] ^ table[6][(a >> 8) & 0xff] ^
+          table[5][(a >> 16) & 0xff] ^ table[4][a >> 24] ^
+          table[3][b & 0xff] ^ table[2][(b >> 8) & 0xff] ^
+          table[1][(b >> 16) & 0xff] ^ table[0][b >> 24];
+  }
+  for(; n > 0; n--, p++)
+    crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xff];
+  return crc;
+}
+
+static uint
+crchw(uint crc, const uchar *p, uint n)
+{
+  for(; n >= 4; n -= 4, p += 4)
+    asm("crc32l %1, %0" : "+r" (crc) : "rm" (*(uint*)p));
+  for(; n > 0; n--, p++)
+    asm("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+  return crc;
+}
+
+// Extend crc (0 to start) with n bytes at p.
+uint
+crc32c(uint crc, const void *p, uint n)
+{
+  if(!ready)
+    crcinit();
+  crc = ~crc;
+  if(usehw)
+    crc = crchw(crc, p, n);
+  else
+    crc = crcsw(crc, p, n);
+  return ~crc;
+}
+
+// Select the implementation: 0 for tables, 1 for the crc32
+// instruction if the cpu has it.  Returns the one now in use.
+int
+crc32cmode(int hw)
+{
+  if(!ready)
+    crcinit();
+  usehw = hw && hashw;
+  return usehw;
+}
@@ -0,0 +1,69 @@
+// Compare the cost of checksumming a segment with the cost of
+// writing one, using the same crc32c code the segment writer runs.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+#include "fcntl.h"
+
+#define NCRC 100 // segments checksummed per timing run
+#define NSEG 4   // segments written through the file system
+#define FBLOCKS 10
+
+char buf[FBLOCKS * BSIZE];
+uint segblocks;
+
+int
+crcticks(void)
+{
+  int st, k, i;
+  uint crc = 0;
+
+  st = uptime();
+  for (k = 0; k < NCRC; k++)
+    for (i = 0; i < SEGDATABLOCKS; i++)
+      crc = crc32c(crc, buf + (i % FBLOCKS) * BSIZE, BSIZE);
+  if (crc == 0)
+    printf(1, "crcbench: unlikely crc\n");
+  return uptime() - st;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct lfsstat ls;
+  int i, fd, st, wr, sw, hw;
+
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = i * 7 + (i >> 11);
+  if (lfsstat(&ls) < 0) {
+    printf(2, "crcbench: lfsstat failed\n");
+    exit();
+  }
+  segblocks = ls.segblocks;
+
+  crc32cmode(0);
+  sw = crcticks();
+  printf(1, "slice-by-8: %d ticks per %d segments\n", sw, NCRC);
+  if (crc32cmode(1)) {
+    hw = crcticks();
+    printf(1, "sse4.2:     %d ticks per %d segments\n", hw, NCRC);
+  } else
+    printf(1, "sse4.2:     not available\n");
+
+  // every pass rewrites FBLOCKS data blocks into the log
+  st = uptime();
+  for (i = 0; i < NSEG * SEGDATABLOCKS / FBLOCKS; i++) {
+    if ((fd = open("crcbench.tmp", O_CREATE | O_RDWR)) < 0 ||
+        write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      printf(1, "crcbench: write failed\n");
+      exit();
+    }
+    close(fd);
+  }
+  sync();
+  wr = (uptime() - st) * NCRC / NSEG;
+  printf(1, "write:      %d ticks per %d segments\n", wr, NCRC);
+  exit();
+}
@@ -7,13 +7,47 @@ struct proc;
 struct spinlock;
 struct stat;
 struct disk_superblock;
+struct lfsstat;
+struct seg_summary;
+struct seg_usage;
 
 // bio.c
 void            binit(void);
 struct buf*     balloc(uint);
 struct buf*     bread(uint, uint);
+void            bprefetch(uint, uint);
+void            bref(uint, uint);
 void            brelse(struct buf*);
+void            bunref(uint, uint);
 uint            bwrite(struct buf*);
+void            bsync(uint);
+uint            btrans(uint);
+void            bcheckpoint(uint);
+int             bdedup(uint);
+void            bforget(uint, uint, uint);
+uint            bstable(uint, uint*);
+void            binval(uint, uint, uint);
+int             bshrink(void);
+void            segrecover(uint, struct disk_superblock*);
+int             segsummary(uint, uint, struct seg_summary*);
+
+// cleaner.c
+int             cleanerctl(int);
+int             cleanpolicy(uint);
+void            cleanerinit(void);
+void            cleanreserve(void);
+extern struct lfsstat lfsstat;
+uint            segalloc(uint, uint);
+int             segclean(uint, uint);
+int             segmarkclean(uint);
+void            segstat(struct lfsstat*);
+int             segusage(struct seg_usage*, int);
+int             snapcreate(void);
+int             snapdelete(int);
+void            sutinit(uint, struct disk_superblock*);
+void            sutlive(uint, uint, int);
+int             sutshare(uint, uint, int);
+void            sutwritten(uint, uint, uint);
 
 // console.c
 void            consoleinit(void);
@@ -21,6 +55,10 @@ void            cprintf(char*, ...);
 void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 
+// crc.c
+uint            crc32c(uint, const void*, uint);
+int             crc32cmode(int);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -34,29 +72,57 @@ int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
 
 // fs.c
-struct disk_superblock* getsb(void);
-void            flushsb(void);
+struct disk_superblock* getsb(uint);
+void            flushsb(uint);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+int             blive(uint, uint, uint, uint);
+int             irelog(uint, uint, uint, uint, uint*);
+int             iremap(uint, uint, uint, uint, uint);
 struct inode*   ialloc(uint, short);
+int             iclone(struct inode*, struct inode*);
+int             idefrag(struct inode*);
+int             ifsync(struct inode*);
+int             ifmap(struct inode*, uint*, int);
+int             ipunch(struct inode*, uint, uint);
+void            ireplay(uint, uint, uint, uchar*, struct buf**);
+int             iseekdata(struct inode*, uint, int);
 struct inode*   idup(struct inode*);
+int             isnapdrop(uint);
+void            itrans(void);
 void            iinit(void);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+int             imount(uint, struct inode*);
+int             imounted(struct inode*);
+int             lfsvol(uint);
+uint            lfsdev(int);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
+struct inode*   namesnap(int, char*);
 int             readi(struct inode*, char*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
 // ide.c
 void            ideinit(void);
-void            ideintr(void);
+void            ideintr(int);
 void            iderw(struct buf*);
+void            iderwv(struct buf**, int);
+void            idesubmit(struct buf**, int, void (*)(struct buf*));
+int             ideidle(uint);
+uint            idesize(uint);
+int             idestripe(uint, uint);
+
+// ilog.c
+uint            ilogcut(uint, uint);
+void            iloginit(uint, struct disk_superblock*);
+int             ilogon(uint);
+int             ilogwrite(uint, uint, uint, uchar*, struct buf**, int);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -66,6 +132,7 @@ void            ioapicinit(void);
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
+uint            kfreepages(void);
 void            kinit(void);
 
 // kbd.c
@@ -79,6 +146,10 @@ void            lapicinit(int);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
 
+// lz.c
+int             lzcompress(const uchar*, uint, uchar*, uint);
+int             lzdecompress(const uchar*, uint, uchar*, uint);
+
 // mp.c
 extern int      ismp;
 int             mpbcpu(void);
@@ -101,14 +172,17 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+void            kproc(char*, void(*)(void));
 void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
+void            sleepq(struct proc**, struct spinlock*);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
+void            wakeupq(struct proc**);
 void            yield(void);
 
 // swtch.S
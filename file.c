@@ -115,6 +115,7 @@ filewrite(struct file *f, char *addr, int n)
   if(f->type == FD_PIPE)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
+    cleanreserve();
     ilock(f->ip);
     if((r = writei(f->ip, addr, f->off, n)) > 0)
       f->off += r;
@@ -16,6 +16,7 @@ struct inode {
   uint inum;          // Inode number
   int ref;            // Reference count
   int flags;          // I_BUSY, I_VALID
+  uint snap;          // snapshot slot + 1, or 0 for the live file system
 
   short type;         // copy of disk inode
   short major;
@@ -23,6 +24,7 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+  uint fflags;        // F_ flags
 };
 
 #define I_BUSY 0x1
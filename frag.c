@@ -0,0 +1,57 @@
+// Report how many contiguous runs each file's blocks form;
+// with -d, defragment the files and report again.
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+
+#define NBLOCKS (NDIRECT + NINDIRECT)
+
+uint addrs[NBLOCKS];
+
+void
+report(char *path, int fd)
+{
+  int i, n, runs;
+
+  n = fmap(fd, addrs, NBLOCKS);
+  if(n < 0){
+    printf(2, "frag: cannot map %s\n", path);
+    return;
+  }
+  runs = 0;
+  for(i = 0; i < n; i++)
+    // blocks packed together share a disk block
+    if(i == 0 || (addrs[i] != addrs[i-1] + 1 && addrs[i] != addrs[i-1]))
+      runs++;
+  printf(1, "%s: %d blocks in %d runs\n", path, n, runs);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, fd, d, n;
+
+  d = argc > 1 && strcmp(argv[1], "-d") == 0;
+  if(argc < 2 + d){
+    printf(2, "usage: frag [-d] file...\n");
+    exit();
+  }
+  for(i = 1 + d; i < argc; i++){
+    if((fd = open(argv[i], 0)) < 0){
+      printf(2, "frag: cannot open %s\n", argv[i]);
+      continue;
+    }
+    report(argv[i], fd);
+    if(d){
+      if((n = defrag(fd)) < 0)
+        printf(2, "frag: cannot defragment %s\n", argv[i]);
+      else {
+        printf(1, "%s: moved %d blocks\n", argv[i], n);
+        report(argv[i], fd);
+      }
+    }
+    close(fd);
+  }
+  exit();
+}
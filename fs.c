@@ -22,37 +22,197 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static struct inode* iget(uint dev, uint inum);
+
+uint segblocks; // from the root's superblock
+
+// Mounted file systems.  Slot 0 is the root, whose superblock is
+// read on first use; mount fills the others.  A slot's dev is set
+// once and not cleared, so lfsvol() looks without the lock.
+struct {
+  struct spinlock lock;
+  int busy; // a mount is in progress
+  struct inode *covering; // the directory it will cover, guarded by busy
+  struct {
+    uint dev; // 0 if the slot is free
+    struct disk_superblock sb;
+    struct inode *on; // directory the volume's root covers
+  } vol[NMOUNT];
+} mtab;
+
+// The mount slot of dev, or -1 if no file system is mounted on it.
+int
+lfsvol(uint dev)
+{
+  int v;
+
+  for (v = 0; v < NMOUNT; v++)
+    if (mtab.vol[v].dev == dev && dev != 0)
+      return v;
+  return -1;
+}
+
+// The device mounted in slot v, or 0.
+uint
+lfsdev(int v)
+{
+  return v >= 0 && v < NMOUNT ? mtab.vol[v].dev : 0;
+}
+
+// Read the superblock of dev into sb.  Returns -1 if it is not one
+// this kernel can use.
+static int
+sbread(uint dev, struct disk_superblock *sb)
+{
+  struct buf *bp;
+
+  bp = bread(dev, 1);
+  memmove(sb, bp->data, sizeof(*sb));
+  brelse(bp);
+  if (sb->bsize != BSIZE || sb->segblocks <= SEGMETABLOCKS ||
+      sb->segblocks > MAXSEGBLOCKS || sb->nblocks == 0)
+    return -1;
+  return 0;
+}
 
 // Read the super block.
 struct disk_superblock *
-getsb(void)
+getsb(uint dev)
 {
-  static struct disk_superblock _sb;
-  if (_sb.nblocks == 0) {
-    struct buf *bp;
-    bp = bread(ROOTDEV, 1);
-    memmove(&_sb, bp->data, sizeof(_sb));
-    brelse(bp);
+  struct disk_superblock *sb;
+  int v;
+
+  if ((v = lfsvol(dev)) < 0)
+    panic("getsb: not mounted");
+  sb = &mtab.vol[v].sb;
+  if (sb->nblocks == 0) {
+    if (sbread(dev, sb) < 0)
+      panic("getsb: geometry");
+    if (idestripe(dev, sb->stripe) < 0)
+      panic("getsb: stripe disk missing");
+    segblocks = sb->segblocks;
+    segrecover(dev, sb);
+    sutinit(dev, sb);
+    iloginit(dev, sb);
+  }
+  return sb;
+}
+
+// Mount the file system on disk dev over directory ip, which the
+// caller has checked is not a volume's root, and whose reference the
+// mount keeps.  ip is unlocked while the volume is recovered, since
+// the cleaner may need it then; imounted() already counts it.  The volume must have the root's
+// geometry, no stripe and no intent log.  Returns -1 if it cannot
+// be mounted.
+int
+imount(uint dev, struct inode *ip)
+{
+  struct disk_superblock *sb;
+  int v, r;
+
+  acquire(&mtab.lock);
+  while (mtab.busy)
+    sleep(&mtab, &mtab.lock);
+  mtab.busy = 1;
+  release(&mtab.lock);
+
+  r = -1;
+  for (v = 0; v < NMOUNT; v++)
+    if (mtab.vol[v].dev == 0 || mtab.vol[v].dev == dev || mtab.vol[v].on == ip)
+      break;
+  if (v == NMOUNT || mtab.vol[v].dev != 0 || idesize(dev) == 0 ||
+      dev == getsb(ROOTDEV)->stripe || dev == getsb(ROOTDEV)->ilog)
+    goto out;
+  sb = &mtab.vol[v].sb;
+  if (sbread(dev, sb) < 0 || sb->segblocks != segblocks || sb->stripe != 0 ||
+      sb->ilog != 0) {
+    memset(sb, 0, sizeof(*sb));
+    goto out;
+  }
+  // keep unlink off ip, which may have gone since the caller looked
+  ilock(ip);
+  if (ip->nlink == 0) {
+    iunlock(ip);
+    memset(sb, 0, sizeof(*sb));
+    goto out;
   }
-  return &_sb;
+  mtab.covering = ip;
+  iunlock(ip);
+
+  // from here the volume's writer and usage table are in use
+  mtab.vol[v].dev = dev;
+  segrecover(dev, sb);
+  sutinit(dev, sb);
+  ilock(ip);
+  mtab.vol[v].on = ip;
+  mtab.covering = 0;
+  iunlock(ip);
+  r = 0;
+
+out:
+  acquire(&mtab.lock);
+  mtab.busy = 0;
+  wakeup(&mtab);
+  release(&mtab.lock);
+  return r;
+}
+
+// The root of the volume mounted on ip, or 0.
+static struct inode*
+mountroot(struct inode *ip)
+{
+  int v;
+
+  for (v = 1; v < NMOUNT; v++)
+    if (mtab.vol[v].on == ip)
+      return iget(mtab.vol[v].dev, ROOTINO);
+  return 0;
+}
+
+// Is a volume mounted, or being mounted, on ip?  Caller holds ip's
+// lock, which mount holds too when it claims ip and when it is done.
+int
+imounted(struct inode *ip)
+{
+  int v;
+
+  if (mtab.covering == ip)
+    return 1;
+  for (v = 1; v < NMOUNT; v++)
+    if (mtab.vol[v].on == ip)
+      return 1;
+  return 0;
+}
+
+// The directory the root of volume ip covers, or 0 if ip is not
+// the root of a mounted volume.
+static struct inode*
+mountcover(struct inode *ip)
+{
+  int v;
+
+  if (ip->inum != ROOTINO || ip->snap || (v = lfsvol(ip->dev)) <= 0 || mtab.vol[v].on == 0)
+    return 0;
+  return idup(mtab.vol[v].on);
 }
 
 void
-flushsb(void)
+flushsb(uint dev)
 {
-  struct disk_superblock * sb = getsb();
+  struct disk_superblock * sb = getsb(dev);
   struct buf *bp;
-  bp = bread(ROOTDEV, 1);
+  bp = bread(dev, 1);
   memmove(bp->data, sb, sizeof(*sb));
   bwrite(bp);
   brelse(bp);
 }
 
-// Free a disk block.
+// Free a disk block.  Nothing on disk changes; the block is just
+// no longer live, and the cleaner reclaims its segment later.
 static void
 bfree(int dev, block_t b)
 {
-  cprintf("free: no implemented\n");
+  bunref(dev, b);
 }
 
 // Inodes.
@@ -97,27 +257,47 @@ void
 iinit(void)
 {
   initlock(&icache.lock, "icache");
+  initlock(&mtab.lock, "mtab");
+  mtab.vol[0].dev = ROOTDEV;
 }
 
-inode_t imapalloc(void)
+inode_t imapalloc(uint dev)
 {
-  return getsb()->ninodes++;
+  return getsb(dev)->ninodes++;
 }
 
 void imapset(int dev, inode_t inum, block_t new)
 {
-  struct buf * bp = bread(dev, getsb()->imap);
+  struct buf * bp = bread(dev, getsb(dev)->imap);
   block_t * imap = (block_t *)bp->data;
   if (inum >= MAX_INODES)
     panic("imapset");
   imap[inum] = new;
-  getsb()->imap = bwrite(bp);
+  bp->head = HEAD_HOT;
+  bp->inum = 0;
+  bp->bn = BN_IMAP;
+  getsb(dev)->imap = bwrite(bp);
+  brelse(bp);
+}
+
+// Block holding inode inum, or 0 if it has none.
+static block_t
+imaplookup(uint dev, uint inum)
+{
+  struct buf *bp;
+  block_t b;
+
+  if(inum >= getsb(dev)->ninodes || inum >= MAX_INODES)
+    return 0;
+  bp = bread(dev, getsb(dev)->imap);
+  b = *((block_t *)bp->data + inum);
   brelse(bp);
+  return b;
 }
 
-void imapget(int dev, uint inum, struct disk_inode * out)
+void imapget(int dev, block_t imap, uint inum, struct disk_inode * out)
 {
-  struct buf * bp  = bread(dev, getsb()->imap);
+  struct buf * bp  = bread(dev, imap);
   block_t b = *((block_t *)bp->data + inum); // imap[inum]
   brelse(bp);
 
@@ -130,6 +310,7 @@ void imapget(int dev, uint inum, struct disk_inode * out)
 }
 
 static struct inode* iget(uint dev, uint inum);
+static struct inode* isnapget(uint dev, uint inum, uint snap);
 
 // Allocate a new inode with the given type on device dev.
 struct inode*
@@ -137,9 +318,13 @@ ialloc(uint dev, short type)
 {
   struct buf * bp = balloc(dev);
   struct disk_inode * dip = (struct disk_inode *)(bp->data);
+  memset(bp->data, 0, BSIZE);
   dip->type = type;
+  bp->head = HEAD_HOT;
 
-  inode_t inum = imapalloc();
+  inode_t inum = imapalloc(dev);
+  bp->inum = inum;
+  bp->bn = BN_INODE;
   imapset(dev, inum, bwrite(bp));
   brelse(bp);
   return iget(dev, inum);
@@ -153,7 +338,7 @@ iupdate(struct inode *ip)
   
   // instead of just balloc()'ing a new block for every iupdate,
   // we can try for a cached block by bread()'ing the disk inode
-  struct buf * imap_bp = bread(ip->dev, getsb()->imap);
+  struct buf * imap_bp = bread(ip->dev, getsb(ip->dev)->imap);
   block_t b = *((block_t *)imap_bp->data + ip->inum);
   brelse(imap_bp);
 
@@ -162,31 +347,58 @@ iupdate(struct inode *ip)
 
   struct buf * bp = bread(ip->dev, b);
 
+  // keep the double indirect address, which ip does not hold
+  memmove(&dip, bp->data, sizeof(dip));
   dip.type = ip->type;
   dip.major = ip->major;
   dip.minor = ip->minor;
   dip.nlink = ip->nlink;
   dip.size = ip->size;
+  dip.fflags = ip->fflags;
 
   memmove(dip.addrs, ip->addrs, sizeof(ip->addrs));
   memmove(bp->data, &dip, sizeof(dip));
+  bp->head = HEAD_HOT;
+  bp->inum = ip->inum;
+  bp->bn = BN_INODE;
   imapset(ip->dev, ip->inum, bwrite(bp));
   brelse(bp);
 }
 
+// Drop ip from the imap, leaving its block dead.
+static void
+ifree(struct inode *ip)
+{
+  bfree(ip->dev, imaplookup(ip->dev, ip->inum));
+  imapset(ip->dev, ip->inum, 0);
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy.
 static struct inode*
 iget(uint dev, uint inum)
+{
+  return isnapget(dev, inum, 0);
+}
+
+// Same, as of snapshot slot snap-1, or the live file system if
+// snap is 0.  Snapshot inodes are read-only.  Returns 0 if the
+// snapshot has been dropped.
+static struct inode*
+isnapget(uint dev, uint inum, uint snap)
 {
   struct inode *ip, *empty;
 
   acquire(&icache.lock);
+  if(snap && getsb(dev)->snap[snap-1].imap == 0){
+    release(&icache.lock);
+    return 0;
+  }
 
   // Try for cached inode.
   empty = 0;
   for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum && ip->snap == snap){
       ip->ref++;
       release(&icache.lock);
       return ip;
@@ -202,6 +414,7 @@ iget(uint dev, uint inum)
   ip = empty;
   ip->dev = dev;
   ip->inum = inum;
+  ip->snap = snap;
   ip->ref = 1;
   ip->flags = 0;
   release(&icache.lock);
@@ -209,6 +422,52 @@ iget(uint dev, uint inum)
   return ip;
 }
 
+// Point ip at the real addresses of blocks that were pending when
+// they were last written.
+static void
+iaddrtrans(struct inode *ip)
+{
+  int k;
+
+  for(k = 0; k < NELEM(ip->addrs); k++)
+    ip->addrs[k] = btrans(ip->addrs[k]);
+}
+
+// iaddrtrans every cached inode.  Called by the segment writer.  A
+// locked inode's holder may be storing into addrs, so it is left for
+// the holder, which translates at iunlock.
+void
+itrans(void)
+{
+  struct inode *ip;
+
+  acquire(&icache.lock);
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++)
+    if(ip->ref > 0 && (ip->flags & (I_VALID|I_BUSY)) == I_VALID)
+      iaddrtrans(ip);
+  release(&icache.lock);
+}
+
+// Empty snapshot slot snap-1, unless a file in it is in use.  Under
+// icache.lock, so isnapget() either finds the slot empty or holds a
+// reference that stops this.  Returns -1 if a file is in use.
+int
+isnapdrop(uint snap)
+{
+  struct inode *ip;
+  int busy;
+
+  busy = 0;
+  acquire(&icache.lock);
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++)
+    if(ip->ref > 0 && ip->snap == snap)
+      busy = 1;
+  if(!busy)
+    getsb(ROOTDEV)->snap[snap-1].imap = 0;
+  release(&icache.lock);
+  return busy ? -1 : 0;
+}
+
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode*
@@ -236,12 +495,16 @@ ilock(struct inode *ip)
   release(&icache.lock);
 
   if(!(ip->flags & I_VALID)) {
-    imapget(ip->dev, ip->inum, &dip);
+    if(ip->snap)
+      imapget(ip->dev, getsb(ip->dev)->snap[ip->snap-1].imap, ip->inum, &dip);
+    else
+      imapget(ip->dev, getsb(ip->dev)->imap, ip->inum, &dip);
     ip->type = dip.type;
     ip->major = dip.major;
     ip->minor = dip.minor;
     ip->nlink = dip.nlink;
     ip->size = dip.size;
+    ip->fflags = dip.fflags;
     memmove(ip->addrs, dip.addrs, sizeof(ip->addrs));
     ip->flags |= I_VALID;
     if(ip->type == 0)
@@ -256,6 +519,7 @@ iunlock(struct inode *ip)
   if(ip == 0 || !(ip->flags & I_BUSY) || ip->ref < 1)
     panic("iunlock");
 
+  iaddrtrans(ip);
   acquire(&icache.lock);
   ip->flags &= ~I_BUSY;
   wakeup(ip);
@@ -267,7 +531,7 @@ void
 iput(struct inode *ip)
 {
   acquire(&icache.lock);
-  if(ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0){
+  if(ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0 && ip->snap == 0){
     // inode is no longer used: truncate and free inode.
     if(ip->flags & I_BUSY)
       panic("iput busy");
@@ -275,7 +539,7 @@ iput(struct inode *ip)
     release(&icache.lock);
     itrunc(ip);
     ip->type = 0;
-    iupdate(ip);
+    ifree(ip);
     acquire(&icache.lock);
     ip->flags = 0;
     wakeup(ip);
@@ -297,22 +561,19 @@ iunlockput(struct inode *ip)
 // The contents (data) associated with each inode is stored
 // in a sequence of blocks on the disk.  The first NDIRECT blocks
 // are listed in ip->addrs[].  The next NINDIRECT blocks are 
-// listed in the block ip->addrs[NDIRECT].
+// listed in the block ip->addrs[NDIRECT].  A 0 address is a hole,
+// which reads as zeroes.
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// Return the disk block address of the nth block in inode ip,
+// or 0 if it is a hole.
 static uint
 bmap(struct inode *ip, uint bn)
 {
   uint addr, *a;
   struct buf *bp;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      panic("bmap");
-      //ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
-  }
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
   bn -= NDIRECT;
   panic("indirect");
 
@@ -341,7 +602,6 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  panic("itrunc");
   int i, j;
   struct buf *bp;
   uint *a;
@@ -369,6 +629,113 @@ itrunc(struct inode *ip)
   iupdate(ip);
 }
 
+// Copy the disk addresses of ip's first n blocks into addrs.
+// Returns how many were copied.  Blocks past the single indirect
+// block read as 0.
+int
+ifmap(struct inode *ip, uint *addrs, int n)
+{
+  struct buf *bp;
+  int i, nb;
+
+  nb = (ip->size + BSIZE - 1) / BSIZE;
+  if(nb > n)
+    nb = n;
+  for(i = 0; i < nb && i < NDIRECT; i++)
+    addrs[i] = PACKBLOCK(btrans(ip->addrs[i]));
+  if(i < nb && ip->addrs[NDIRECT] != 0){
+    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    for(; i < nb && i < NDIRECT + NINDIRECT; i++)
+      addrs[i] = ((uint*)bp->data)[i - NDIRECT];
+    brelse(bp);
+  }
+  for(; i < nb; i++)
+    addrs[i] = 0;
+  return nb;
+}
+
+// Tag bp as block bn of ip's data, going to log head.
+static void
+idata(struct inode *ip, struct buf *bp, uint bn, int head)
+{
+  bp->head = head;
+  bp->inum = ip->inum;
+  bp->bn = bn;
+  if(ip->fflags & F_NOCOMPRESS)
+    bp->flags |= B_RAW;
+  else
+    bp->flags &= ~B_RAW;
+}
+
+// Rewrite ip's direct blocks in file order at the cold log head, so
+// a file scattered by overwrites reads back as one run.  Blocks
+// behind indirect blocks stay put.  Caller holds ip's lock.
+// Returns the number of blocks moved.
+int
+idefrag(struct inode *ip)
+{
+  struct buf *bp;
+  int bn, n;
+
+  // pending blocks keep the address they were given, so get them
+  // out of the way first
+  bsync(ip->dev);
+  n = 0;
+  for(bn = 0; bn < NDIRECT; bn++){
+    if(ip->addrs[bn] == 0)
+      continue;
+    bp = bread(ip->dev, ip->addrs[bn]);
+    idata(ip, bp, bn, HEAD_COLD);
+    ip->addrs[bn] = bwrite(bp);
+    brelse(bp);
+    n++;
+  }
+  if(n > 0)
+    iupdate(ip);
+  return n;
+}
+
+// Make dst a copy of the file src sharing its blocks.  A write to
+// either copies the block it changes, as every write does, so the two
+// part ways block by block.  Files with indirect blocks cannot be
+// cloned.  Neither inode may be locked: they are locked here in inum
+// order, so clones of two files onto each other cannot deadlock.
+int
+iclone(struct inode *dst, struct inode *src)
+{
+  int i;
+
+  if(src->dev != dst->dev || src == dst)
+    return -1;
+  if(src->inum < dst->inum){
+    ilock(src);
+    ilock(dst);
+  } else {
+    ilock(dst);
+    ilock(src);
+  }
+  if(src->type != T_FILE || src->addrs[NDIRECT] != 0 || dst->type != T_FILE){
+    iunlock(src);
+    iunlock(dst);
+    return -1;
+  }
+  itrunc(dst);
+  // pending blocks are written over in place, so they cannot be
+  // shared until they have their addresses
+  bsync(src->dev);
+  for(i = 0; i < NDIRECT; i++){
+    dst->addrs[i] = src->addrs[i];
+    if(src->addrs[i])
+      bref(dst->dev, src->addrs[i]);
+  }
+  dst->size = src->size;
+  dst->fflags = src->fflags;
+  iunlock(src);
+  iupdate(dst);
+  iunlock(dst);
+  return 0;
+}
+
 // Copy stat information from inode.
 void
 stati(struct inode *ip, struct stat *st)
@@ -384,7 +751,7 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr, bn;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -399,14 +766,34 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    // get the next blocks coming while this one is copied
+    for(bn = off/BSIZE + 1; bn <= off/BSIZE + NREADAHEAD && bn < NDIRECT &&
+        bn*BSIZE < ip->size; bn++)
+      if(ip->addrs[bn] != 0)
+        bprefetch(ip->dev, ip->addrs[bn]);
+    if((addr = bmap(ip, off/BSIZE)) == 0){
+      memset(dst, 0, m);
+      continue;
+    }
+    bp = bread(ip->dev, addr);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
   }
   return n;
 }
 
+// Log head for block bn of ip.  Directory blocks and data being
+// rewritten are hot; file data written for the first time goes to
+// the cold head, where it is likely to stay live.
+static int
+loghead(struct inode *ip, uint bn)
+{
+  if (ip->type == T_DIR || ip->addrs[bn] != 0)
+    return HEAD_HOT;
+  return HEAD_COLD;
+}
+
 // Write data to inode.
 int
 writei(struct inode *ip, char *src, uint off, uint n)
@@ -418,21 +805,28 @@ writei(struct inode *ip, char *src, uint off, uint n)
       return -1;
     return devsw[ip->major].write(ip, src, n);
   }
+  if(ip->snap)
+    return -1;
 
-  if(off > ip->size || off + n < off)
+  // writing past the end leaves a hole between
+  if(off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     n = MAXFILE*BSIZE - off;
 
+  // lseek can put off anywhere, but only direct blocks are written
   if (off + n > NDIRECT * BSIZE)
-    panic("writei unsupported size");
+    return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     struct buf * bp;
     if (ip->addrs[off/BSIZE] != 0)
       bp = bread(ip->dev, ip->addrs[off/BSIZE]);
-    else
+    else {
       bp = balloc(ip->dev);
+      memset(bp->data, 0, BSIZE);
+    }
+    idata(ip, bp, off/BSIZE, loghead(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
     ip->addrs[off/BSIZE] = bwrite(bp);
@@ -441,12 +835,321 @@ writei(struct inode *ip, char *src, uint off, uint n)
 
   if(n > 0 && off > ip->size)
     ip->size = off;
-
+  lfsstat.userbytes += n;
 
   iupdate(ip);
   return n;
 }
 
+// Punch a hole over bytes off..off+n-1 of ip, which is locked.
+// Blocks wholly inside are freed; the ends are zeroed.  The size
+// does not change.
+int
+ipunch(struct inode *ip, uint off, uint n)
+{
+  struct buf *bp;
+  uint bn, end, m;
+
+  if(off + n < off)
+    return -1;
+  end = min(off + n, ip->size);
+  for(; off < end && off/BSIZE < NDIRECT; off += m){
+    bn = off/BSIZE;
+    m = min(end - off, BSIZE - off%BSIZE);
+    if(ip->addrs[bn] == 0)
+      continue;
+    if(m == BSIZE){
+      bfree(ip->dev, ip->addrs[bn]);
+      ip->addrs[bn] = 0;
+      continue;
+    }
+    bp = bread(ip->dev, ip->addrs[bn]);
+    idata(ip, bp, bn, HEAD_HOT);
+    memset(bp->data + off%BSIZE, 0, m);
+    ip->addrs[bn] = bwrite(bp);
+    brelse(bp);
+  }
+  iupdate(ip);
+  return 0;
+}
+
+// The first offset at or after off that is in data, or with hole
+// set, in a hole.  The end of the file counts as a hole, and blocks
+// past the direct ones as data.  Returns -1 if there is none.
+int
+iseekdata(struct inode *ip, uint off, int hole)
+{
+  uint bn;
+
+  if(off >= ip->size)
+    return -1;
+  for(; off < ip->size; off = (off/BSIZE + 1) * BSIZE){
+    bn = off/BSIZE;
+    if((bn < NDIRECT && ip->addrs[bn] == 0) == hole)
+      return off;
+  }
+  return hole ? ip->size : -1;
+}
+
+// Make ip, which is locked, durable.  A regular file that was in the
+// last complete flush goes to the intent log, as the blocks changed
+// since, if the volume has one with room; anything else flushes the
+// log heads.
+int
+ifsync(struct inode *ip)
+{
+  struct disk_inode dip;
+  struct buf *bp, *data[NDIRECT];
+  uchar state[NDIRECT];
+  block_t imap, a;
+  uint ninodes, bn;
+  int n, i, r;
+
+  if(ip->snap)
+    return 0;
+  r = -1;
+  if(ip->type == T_FILE && ilogon(ip->dev)){
+    imap = bstable(ip->dev, &ninodes);
+    bp = bread(ip->dev, imap);
+    a = ip->inum < ninodes ? ((block_t*)bp->data)[ip->inum] : 0;
+    brelse(bp);
+    if(a != 0){
+      imapget(ip->dev, imap, ip->inum, &dip);
+      n = 0;
+      for(bn = 0; bn < NDIRECT; bn++){
+        a = btrans(ip->addrs[bn]);
+        if(a == dip.addrs[bn])
+          state[bn] = ILOG_KEEP;
+        else if(a == 0)
+          state[bn] = ILOG_HOLE;
+        else {
+          state[bn] = ILOG_DATA;
+          data[n++] = bread(ip->dev, ip->addrs[bn]);
+        }
+      }
+      // a record only carries the size and the blocks
+      if(dip.type == ip->type && dip.fflags == ip->fflags && dip.nlink == ip->nlink)
+        r = ilogwrite(ip->dev, ip->inum, ip->size, state, data, n);
+      for(i = 0; i < n; i++)
+        brelse(data[i]);
+    }
+  }
+  if(r < 0)
+    bsync(ip->dev);
+  return 0;
+}
+
+// Apply an intent log record to inode inum of dev: blocks marked
+// ILOG_DATA get the contents in data, in order, those marked
+// ILOG_HOLE are freed, and the size is set.
+void
+ireplay(uint dev, uint inum, uint size, uchar *state, struct buf **data)
+{
+  struct inode *ip;
+  uint bn;
+  int i;
+
+  if(inum == 0 || inum >= getsb(dev)->ninodes || imaplookup(dev, inum) == 0)
+    return;
+  ip = iget(dev, inum);
+  ilock(ip);
+  if(ip->type == T_FILE){
+    i = 0;
+    for(bn = 0; bn < NDIRECT; bn++){
+      if(state[bn] == ILOG_DATA){
+        // a replay is not the user writing again
+        if(writei(ip, (char*)data[i++]->data, bn*BSIZE, BSIZE) > 0)
+          lfsstat.userbytes -= BSIZE;
+      } else if(state[bn] == ILOG_HOLE && ip->addrs[bn] != 0){
+        bfree(ip->dev, ip->addrs[bn]);
+        ip->addrs[bn] = 0;
+      }
+    }
+    ip->size = size;
+    iupdate(ip);
+  }
+  iunlockput(ip);
+}
+
+// Does a snapshot hold the block at addr, written for block bn of
+// inode inum?
+static int
+snapheld(uint dev, uint inum, uint bn, block_t addr)
+{
+  struct disk_snapshot *sp;
+  struct buf *bp;
+  block_t b;
+  int held;
+
+  for(sp = getsb(dev)->snap; sp < getsb(dev)->snap + NSNAP; sp++){
+    if(sp->imap == 0)
+      continue;
+    if(bn == BN_IMAP){
+      if(sp->imap == addr)
+        return 1;
+      continue;
+    }
+    if(inum == 0 || inum >= sp->ninodes)
+      continue;
+    bp = bread(dev, sp->imap);
+    b = ((block_t*)bp->data)[inum];
+    brelse(bp);
+    if(b == 0)
+      continue;
+    if(bn == BN_INODE){
+      if(b == addr)
+        return 1;
+      continue;
+    }
+    bp = bread(dev, b);
+    held = ((struct disk_inode*)bp->data)->addrs[bn] == addr;
+    brelse(bp);
+    if(held)
+      return 1;
+  }
+  return 0;
+}
+
+// Copy out the entries of the pack at addr.
+static void
+packentries(uint dev, block_t addr, struct pack_entry *e)
+{
+  struct buf *bp;
+
+  bp = bread(dev, addr);
+  memmove(e, ((struct disk_pack*)bp->data)->entries, NPACK * sizeof(*e));
+  brelse(bp);
+}
+
+// Is the block at addr, written for block bn of inode inum, still
+// in use?  Blocks the cleaner has no way to check count as live.
+// A pack is live while any block in it is.
+int
+blive(uint dev, uint inum, uint bn, block_t addr)
+{
+  struct pack_entry e[NPACK];
+  struct disk_inode *dip;
+  struct buf *bp;
+  block_t b;
+  int live, i;
+
+  if(bn == BN_PACK){
+    packentries(dev, addr, e);
+    for(i = 0; i < NPACK; i++)
+      if(e[i].inum != 0 && blive(dev, e[i].inum, e[i].bn, PACKADDR(addr, i)))
+        return 1;
+    return 0;
+  }
+  if(bn == BN_IMAP)
+    return getsb(dev)->imap == addr || snapheld(dev, inum, bn, addr);
+  if(bn == BN_INDIRECT || (bn >= NDIRECT && bn != BN_INODE))
+    return 1;
+  if(snapheld(dev, inum, bn, addr))
+    return 1;
+  if(inum == 0 || inum >= getsb(dev)->ninodes || (b = imaplookup(dev, inum)) == 0)
+    return 0;
+  if(bn == BN_INODE)
+    return b == addr;
+
+  bp = bread(dev, b);
+  dip = (struct disk_inode*)bp->data;
+  live = dip->type != 0 && dip->addrs[bn] == addr;
+  brelse(bp);
+  return live;
+}
+
+// Copy the block at addr, written for block bn of inode inum, to
+// the head of the log if it is still in use; a pack's blocks are
+// copied one by one.  Returns -1 if it is but cannot be moved, 0
+// otherwise.  If to is not 0, a moved data
+// block's new address is left there, else 0.
+int
+irelog(uint dev, uint inum, uint bn, block_t addr, block_t *to)
+{
+  struct pack_entry e[NPACK];
+  struct inode *ip;
+  struct buf *bp;
+  int i, r;
+
+  if(to)
+    *to = 0;
+  if(bn == BN_PACK){
+    packentries(dev, addr, e);
+    r = 0;
+    for(i = 0; i < NPACK; i++)
+      if(e[i].inum != 0 && irelog(dev, e[i].inum, e[i].bn, PACKADDR(addr, i), 0) < 0)
+        r = -1;
+    return r;
+  }
+  if(bn == BN_INDIRECT || (bn >= NDIRECT && bn != BN_INODE && bn != BN_IMAP))
+    return -1;
+  // snapshots are never rewritten, so their blocks stay put
+  if(snapheld(dev, inum, bn, addr))
+    return -1;
+  if(bn == BN_IMAP){
+    bp = bread(dev, addr);
+    // holding the buffer keeps imapset from moving the imap
+    if(getsb(dev)->imap == addr){
+      bp->head = HEAD_HOT;
+      bp->inum = 0;
+      bp->bn = BN_IMAP;
+      getsb(dev)->imap = bwrite(bp);
+    }
+    brelse(bp);
+    return 0;
+  }
+
+  // the reference keeps the inode from being freed once it is
+  // seen in the imap
+  ip = iget(dev, inum);
+  if(imaplookup(dev, inum) == 0){
+    iput(ip);
+    return 0;
+  }
+  ilock(ip);
+  if(bn == BN_INODE){
+    if(imaplookup(dev, inum) == addr)
+      iupdate(ip);
+  } else if(ip->addrs[bn] == addr){
+    bp = bread(dev, addr);
+    idata(ip, bp, bn, HEAD_COLD);
+    ip->addrs[bn] = bwrite(bp);
+    brelse(bp);
+    iupdate(ip);
+    if(to)
+      *to = ip->addrs[bn];
+  }
+  iunlockput(ip);
+  return 0;
+}
+
+// Point block bn of inode inum, if it still refers to from, at the
+// copy of it at to.  Returns 1 if it did.
+int
+iremap(uint dev, uint inum, uint bn, block_t from, block_t to)
+{
+  struct inode *ip;
+  int moved;
+
+  if(bn >= NDIRECT)
+    return 0;
+  ip = iget(dev, inum);
+  if(imaplookup(dev, inum) == 0){
+    iput(ip);
+    return 0;
+  }
+  ilock(ip);
+  moved = ip->addrs[bn] == from;
+  if(moved){
+    ip->addrs[bn] = to;
+    bref(dev, to);
+    bfree(dev, from);
+    iupdate(ip);
+  }
+  iunlockput(ip);
+  return moved;
+}
+
 // Directories
 
 int
@@ -481,7 +1184,7 @@ dirlookup(struct inode *dp, char *name, uint *poff)
           *poff = off + (uchar*)de - bp->data;
         inum = de->inum;
         brelse(bp);
-        return iget(dp->dev, inum);
+        return isnapget(dp->dev, inum, dp->snap);
       }
     }
     brelse(bp);
@@ -562,13 +1265,14 @@ skipelem(char *path, char *name)
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
 static struct inode*
-namex(char *path, int nameiparent, char *name)
+namex(char *path, int nameiparent, char *name, uint snap)
 {
   struct inode *ip, *next;
 
-  if(*path == '/')
-    ip = iget(ROOTDEV, ROOTINO);
-  else
+  if(*path == '/' || snap){
+    if((ip = isnapget(ROOTDEV, ROOTINO, snap)) == 0)
+      return 0;
+  } else
     ip = idup(proc->cwd);
 
   while((path = skipelem(path, name)) != 0){
@@ -582,12 +1286,22 @@ namex(char *path, int nameiparent, char *name)
       iunlock(ip);
       return ip;
     }
+    // .. leaves a mounted volume through the directory it covers
+    if(namecmp(name, "..") == 0 && (next = mountcover(ip)) != 0){
+      iunlockput(ip);
+      ip = next;
+      ilock(ip);
+    }
     if((next = dirlookup(ip, name, 0)) == 0){
       iunlockput(ip);
       return 0;
     }
     iunlockput(ip);
     ip = next;
+    if(!ip->snap && (next = mountroot(ip)) != 0){
+      iput(ip);
+      ip = next;
+    }
   }
   if(nameiparent){
     iput(ip);
@@ -600,11 +1314,22 @@ struct inode*
 namei(char *path)
 {
   char name[DIRSIZ];
-  return namex(path, 0, name);
+  return namex(path, 0, name, 0);
 }
 
 struct inode*
 nameiparent(char *path, char *name)
 {
-  return namex(path, 1, name);
+  return namex(path, 1, name, 0);
+}
+
+// Look up path in snapshot k, relative to its root.
+struct inode*
+namesnap(int k, char *path)
+{
+  char name[DIRSIZ];
+
+  if(k < 0 || k >= NSNAP || getsb(ROOTDEV)->snap[k].imap == 0)
+    return 0;
+  return namex(path, 0, name, k + 1);
 }
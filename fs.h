@@ -1,12 +1,20 @@
 #ifndef __FS_H__
 #define __FS_H__
 
+// The block size is fixed at build time (make BSIZE=n) and checked
+// against the superblock at mount.  The segment size is picked by
+// mkfs -g and read from the superblock into segblocks.
+#ifndef BSIZE
 #define BSIZE (2048)
-#define SEGSIZE (1024*512) // 512kb
-#define SEGBLOCKS (SEGSIZE/BSIZE)
+#endif
+#define SEGSIZE (1024*512) // 512kb, mkfs's default
+#define MAXSEGBLOCKS (4*1024*1024/BSIZE) // largest segment, 4mb
+#define SEGBLOCKS (segblocks)
 #define SEGMETABLOCKS (1)
 #define SEGDATABLOCKS (SEGBLOCKS-SEGMETABLOCKS)
 
+extern uint segblocks;
+
 // sectors per block
 #define SPB (BSIZE / 512)
 #define IS_BLOCK_SECTOR(a) (((a) & (SPB - 1)) == 0) // is divisible by SPB
@@ -17,16 +25,127 @@
 #define B2S(b) (((b) - 1) * SPB + 1)
 #define S2B(s) (((s) - 1) / SPB + 1)
 
+// segments are aligned runs of SEGBLOCKS blocks following the superblock
+#define SEGSTART 2
+#define SEG2B(n) (SEGSTART + (n) * SEGBLOCKS)
+#define B2SEG(b) (((b) - SEGSTART) / SEGBLOCKS)
+
 typedef uint block_t;
 typedef uint inode_t;
 
+// Log heads.  Each has its own open segment, so metadata and data
+// that is being rewritten do not share segments with data that was
+// written once and left alone.
+#define HEAD_HOT 0 // imap, inodes, directories, overwritten data
+#define HEAD_COLD 1 // file data written once
+#define NHEADS 2
+
+// cleaning policies
+#define CLEAN_GREEDY 0 // fewest live blocks first
+#define CLEAN_COSTBENEFIT 1 // Sprite LFS: (1-u)*age/(1+u)
+
+#define NSNAP 4 // snapshots kept at once
+
+// A pinned checkpoint.  Its blocks count as live until it is deleted,
+// so the cleaner leaves them where they are.
+struct disk_snapshot {
+	block_t imap; // 0 if the slot is free
+	uint ninodes;
+	uint serial; // of the checkpoint it was taken at
+};
+
 struct disk_superblock {
 	uint nsegs; // number of segments
 	uint segment; // checkpoint
 	block_t imap; // imap block
 	uint ninodes;
 	uint nblocks;
-	uint next; // next empty block
+	uint policy; // cleaning policy
+	uint serial; // serial of the last summary covered by this checkpoint
+	block_t head[NHEADS]; // where each log head's next summary goes
+	struct disk_snapshot snap[NSNAP];
+	uint bsize; // BSIZE the image was made with
+	uint segblocks; // blocks per segment
+	uint stripe; // disk holding the odd segments, 0 if not striped
+	uint ilog; // intent log disk, 0 if there is none
+	uint ilgen; // last intent log generation the log has absorbed
+};
+
+#define SUMMAGIC 0x5346534c // "LSFS"
+
+// summary entries that fit after the 9 header words
+#define SUMENTRIES ((BSIZE - 36) / 4)
+// most data blocks in a partial segment, which bounds how many
+// blocks a log head holds pending
+#define PARTBLOCKS (SUMENTRIES < 255 ? SUMENTRIES : 255)
+
+// A segment is written as one or more partial segments.  Each begins
+// with SEGMETABLOCKS meta blocks, the first holding this summary.
+// Serials run across all log heads.  Recovery rolls forward from the
+// checkpoint through summaries whose serial follows on and whose
+// checksums match, so a torn write ends the log at the last complete
+// partial segment.
+struct seg_summary {
+	uint magic;
+	uint sumcrc; // crc32c of this struct, taken with sumcrc = 0
+	uint datacrc; // crc32c of the nblocks data blocks that follow
+	uint serial; // one more than the previous summary in the log
+	uint nblocks; // data blocks in this partial segment
+	block_t next; // where this head's next summary will go
+	block_t imap; // checkpoint state as of this write
+	uint ninodes;
+	uint ilgen; // intent log generation absorbed as of this write
+	struct seg_entry {
+		ushort inum;
+		ushort bn; // block of the file, or one of the BN_ kinds
+	} entries[SUMENTRIES]; // owner of each data block
+};
+
+#define BN_INODE 0xffff // the inode's own block
+#define BN_IMAP 0xfffe
+#define BN_INDIRECT 0xfffd // written by mkfs, never moved
+#define BN_PACK 0xfffc // a pack of compressed blocks
+
+// A pack block holds up to NPACK data blocks compressed by the
+// segment writer.  Inodes name block i of the pack at block b as
+// PACKADDR(b, i); PACKBLOCK() gives the disk block any address is
+// stored in.
+#define NPACK 4
+#define PACKBASE 0x40000000
+#define PACKED(a) (((a) & 0xc0000000) == PACKBASE)
+#define PACKADDR(b, i) (PACKBASE | (b) << 2 | (i))
+#define PACKBLOCK(a) (PACKED(a) ? ((a) & ~PACKBASE) >> 2 : (a))
+#define PACKSLOT(a) ((a) & (NPACK - 1))
+
+struct disk_pack {
+	struct pack_entry {
+		ushort inum; // 0 if the slot is unused
+		ushort bn;
+		ushort off; // into data
+		ushort len; // compressed length
+	} entries[NPACK];
+	uchar data[BSIZE - NPACK * 8];
+};
+
+// Segment usage table entry.  Kept in memory only; lfssegs() hands
+// a copy to user-level cleaners.
+struct seg_usage {
+	uint live; // live blocks
+	uint age; // serial of the last write into the segment
+	uint flags;
+};
+
+#define SEG_CLEAN 0x1 // empty, may be given to a log head
+#define SEG_ACTIVE 0x2 // open by a log head
+#define SEG_STUCK 0x4 // holds live blocks the cleaner cannot move
+#define SEG_VICTIM 0x8 // being cleaned
+
+// A block as named by a segment summary, for lfsbmapv() and lfsmarkv().
+struct blk_info {
+	ushort inum;
+	ushort bn;
+	block_t addr; // where the summary says it is
+	int live; // set by lfsbmapv()
 };
 
 #define DISK_INODE_DATA 12 // size of disk_inode excluding addrs
@@ -61,10 +180,44 @@ struct disk_inode {
 	short nlink;
 	uint size;
 	block_t addrs[NADDRS];
+	// past the 64 bytes NADDRS is sized for; an inode has a block
+	// to itself
+	uint fflags; // F_ flags
 };
 
 #define IPB (BSIZE/sizeof(disk_inode));
 
+#define F_NOCOMPRESS 0x1 // write the file's data uncompressed
+
+// The intent log disk (mkfs -l) starts with this header in block 1.
+// The rest is two halves, each holding the records of one generation
+// at a time, from its first block on.
+#define ILOGMAGIC 0x474f4c49 // "ILOG"
+#define ILOGBLOCKS 256 // mkfs's size for the disk
+
+struct ilog_header {
+	uint magic;
+	uint nblocks; // on the disk, the header included
+};
+
+// A record is one fsync of a file: this block, then the data of the
+// blocks marked ILOG_DATA in file order.  Each block of the file is
+// given relative to the inode in the log's last complete flush.
+#define ILOG_KEEP 0 // unchanged
+#define ILOG_HOLE 1 // freed
+#define ILOG_DATA 2 // rewritten
+
+struct ilog_record {
+	uint magic;
+	uint crc; // crc32c of this struct, taken with crc = 0
+	uint datacrc; // crc32c of the n data blocks that follow
+	uint gen;
+	uint inum;
+	uint size;
+	uint n;
+	uchar state[NDIRECT];
+};
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
@@ -75,20 +228,31 @@ struct dirent {
 
 // disk block structure
 struct buf {
+  struct proc *waiters; // sleeping until B_BUSY clears, see bio.c
   int flags;
   uint dev;
   block_t block;
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // cache queue
   struct buf *next;
+  int q; // which one, Q_IN or Q_MAIN
+  struct buf *hnext; // hash chain of its name
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  void (*done)(struct buf*); // called by ideintr once an idesubmit is done
+  int head; // log head bwrite appends to
+  inode_t inum; // owner, for the segment summary
+  uint bn;
+  int refs; // references to a pending block, counted live when placed
+  uchar *data; // BSIZE bytes
 };
 
 #define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_RAW   0x8  // do not compress when writing
 
 #define ROOTINO 1
 #define ROOTDEV 1
+#define STRIPEDEV 2 // qemu's -hdc, for the odd segments of a striped root
+#define ILOGDEV 2 // also -hdc, for the root's intent log
 
 #endif
@@ -0,0 +1,78 @@
+// Time a file workload under the geometry this image was built
+// with.  sweep.sh rebuilds the image for each block and segment
+// size and collects the geobench lines.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+#include "fcntl.h"
+
+#define NFILES 16
+
+char buf[BSIZE];
+char name[] = "geo.a";
+
+int
+main(int argc, char *argv[])
+{
+  struct lfsstat ls;
+  int i, k, fd, st, wr, sy, rd, rm;
+  uint dev;
+
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = i * 7 + (i >> 11);
+  if (lfsstat(&ls) < 0) {
+    printf(2, "geobench: lfsstat failed\n");
+    exit();
+  }
+  dev = ls.devbytes;
+
+  st = uptime();
+  for (k = 0; k < NFILES; k++) {
+    name[4] = 'a' + k;
+    if ((fd = open(name, O_CREATE | O_RDWR)) < 0) {
+      printf(2, "geobench: create failed\n");
+      exit();
+    }
+    for (i = 0; i < NDIRECT; i++)
+      if (write(fd, buf, BSIZE) != BSIZE) {
+        printf(2, "geobench: write failed\n");
+        exit();
+      }
+    close(fd);
+  }
+  wr = uptime() - st;
+
+  st = uptime();
+  sync();
+  sy = uptime() - st;
+
+  st = uptime();
+  for (k = 0; k < NFILES; k++) {
+    name[4] = 'a' + k;
+    if ((fd = open(name, O_RDONLY)) < 0) {
+      printf(2, "geobench: open failed\n");
+      exit();
+    }
+    while (read(fd, buf, BSIZE) > 0)
+      ;
+    close(fd);
+  }
+  rd = uptime() - st;
+
+  st = uptime();
+  for (k = 0; k < NFILES; k++) {
+    name[4] = 'a' + k;
+    unlink(name);
+  }
+  sync();
+  rm = uptime() - st;
+
+  lfsstat(&ls);
+  printf(1, "geobench bsize %d segkb %d: %d KB write %d sync %d read %d "
+         "delete %d ticks, %d KB to disk\n", ls.bsize,
+         ls.segblocks * ls.bsize / 1024, NFILES * NDIRECT * BSIZE / 1024,
+         wr, sy, rd, rm, (ls.devbytes - dev) / 1024);
+  exit();
+}
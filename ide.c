@@ -1,8 +1,32 @@
 // Simple PIO-based (non-DMA) IDE driver code.
+//
+// Both channels are driven, each with its own queue, so disks on
+// different channels transfer at the same time.  Disk d is drive
+// d&1 of channel d>>1: 0 and 1 are qemu's -hda and -hdb, 2 and 3
+// its -hdc and -hdd.  A device can be striped over a second disk
+// (idestripe): its odd segments live there, at the same offset the
+// even ones have on the first.
+//
+// Requests wait in two queues per channel, reads and writes, each
+// sorted by disk and sector.  When the channel goes idle the next
+// run is taken C-SCAN style: the first request at or past where the
+// last one ended, wrapping to the lowest, together with the requests
+// for the sectors right after it, as one multi-sector command.
+// Reads go first, since a process is waiting on each, but writes get
+// a turn after IDE_READBURST runs of reads.
+//
+// A process waiting on a channel with at least IDE_POLLDEPTH buffers
+// queued may drive it instead of sleeping: it turns the channel's
+// interrupts off and spins on the status register, finishing each run
+// and starting the next, until its own buffer is done.  Whether that
+// pays is measured: each wait is timed in cycles per queued buffer,
+// and the cheaper way so far is taken, with every IDE_PROBE'th deep
+// wait going the other way to keep both measurements current.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "stat.h"
 #include "mmu.h"
 #include "proc.h"
 #include "x86.h"
@@ -13,144 +37,494 @@
 #define IDE_BSY       0x80
 #define IDE_DRDY      0x40
 #define IDE_DF        0x20
+#define IDE_DRQ       0x08
 #define IDE_ERR       0x01
 
 #define IDE_CMD_READ  0x20
 #define IDE_CMD_WRITE 0x30
+#define IDE_CMD_IDENTIFY 0xec
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+#define NIDE 4  // two drives on each of two channels
+#define IDE_MAXSECT 255  // most sectors in one command
+#define IDE_READBURST 8  // runs of reads while writes wait
+#define IDE_POLLDEPTH 4  // queued buffers worth polling for
+#define IDE_PROBE 16     // deep waits between tries of the other way
 
-static struct spinlock idelock;
-static struct buf *idequeue;
+// active is the run of bufs being read/written to the disk, in
+// sector order through qnext; reads and writes wait, sorted the
+// same way.  You must hold lock while manipulating the queues.
+struct idechan {
+  struct spinlock lock;
+  struct buf *active;
+  struct buf *reads;
+  struct buf *writes;
+  uint pos;     // key just past the last run
+  int nreads;   // runs of reads since writes were waiting
+  int polling;  // a waiter is driving the channel
+  int quiet;    // the active run was started without interrupts
+  struct buf *xbuf;  // buf of the active run's next sector to move
+  int xsect;    // that sector within it
+  int left;     // sectors of the run still to move
+  uint nprobe;  // deep waits so far
+  uint pollcost;  // cycles per buffer of a polled wait, on average
+  uint intrcost;  // and of a wait that slept through interrupts
+  ushort base;  // command block registers
+  ushort ctl;   // device control register
+  int irq;
+};
 
-static int havedisk1;
-static void idestart(struct buf*);
+static struct idechan chans[2] = {
+  { .base = 0x1f0, .ctl = 0x3f6, .irq = IRQ_IDE },
+  { .base = 0x170, .ctl = 0x376, .irq = IRQ_IDE2 },
+};
+static uint idelast;  // ticks at the last request
+
+static int havedisk[NIDE];
+static uint disksize[NIDE];  // sectors, from IDENTIFY DEVICE
+static uint stripe[NIDE];    // disk holding the odd segments, or 0
+static void idestart(struct idechan*, struct buf*, int);
 
 // Wait for IDE disk to become ready.
 static int
-idewait(int checkerr)
+idewait(struct idechan *c, int checkerr)
 {
   int r;
 
-  while(((r = inb(0x1f7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY) 
+  while(((r = inb(c->base+7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY) 
     ;
   if(checkerr && (r & (IDE_DF|IDE_ERR)) != 0)
     return -1;
   return 0;
 }
 
+// Wait for the disk to take or give a sector's data.
+static int
+idedrq(struct idechan *c)
+{
+  int r;
+
+  while((r = inb(c->base+7)) & IDE_BSY)
+    ;
+  if((r & (IDE_DF|IDE_ERR)) != 0 || (r & IDE_DRQ) == 0)
+    return -1;
+  return 0;
+}
+
+// Is drive d of channel c there?  An empty channel floats to 0xff.
+static int
+ideprobe(struct idechan *c, int d)
+{
+  int i, r;
+
+  outb(c->base+6, 0xe0 | (d<<4));
+  for(i=0; i<1000; i++){
+    r = inb(c->base+7);
+    if(r != 0 && r != 0xff)
+      return 1;
+  }
+  return 0;
+}
+
+// Ask disk dev how many sectors it has (LBA28).
+static uint
+ideidentify(int dev)
+{
+  static ushort id[256];
+  struct idechan *c = &chans[dev>>1];
+
+  outb(c->ctl, 2);  // no interrupt
+  outb(c->base+6, 0xe0 | ((dev&1)<<4));
+  outb(c->base+7, IDE_CMD_IDENTIFY);
+  if(inb(c->base+7) == 0 || idewait(c, 1) < 0)
+    return 0;
+  insl(c->base, id, sizeof(id)/4);
+  return id[60] | (id[61] << 16);
+}
+
 void
 ideinit(void)
 {
-  int i;
+  struct idechan *c;
+  int i, dev;
 
-  initlock(&idelock, "ide");
-  picenable(IRQ_IDE);
-  ioapicenable(IRQ_IDE, ncpu - 1);
-  idewait(0);
-  
-  // Check if disk 1 is present
-  outb(0x1f6, 0xe0 | (1<<4));
-  for(i=0; i<1000; i++){
-    if(inb(0x1f7) != 0){
-      havedisk1 = 1;
-      break;
-    }
+  for(i = 0; i < 2; i++){
+    c = &chans[i];
+    initlock(&c->lock, "ide");
+    // disk 0 holds the kernel, so it is there
+    havedisk[2*i] = i == 0 || ideprobe(c, 0);
+    havedisk[2*i+1] = ideprobe(c, 1);
+    if(!havedisk[2*i] && !havedisk[2*i+1])
+      continue;
+    picenable(c->irq);
+    ioapicenable(c->irq, ncpu - 1);
+    idewait(c, 0);
+    for(dev = 2*i; dev < 2*i+2; dev++)
+      if(havedisk[dev])
+        disksize[dev] = ideidentify(dev);
+    // Switch back to drive 0.
+    outb(c->base+6, 0xe0 | (0<<4));
   }
-  
-  // Switch back to disk 0.
-  outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Size of disk dev in sectors, or 0 if it did not say.
+uint
+idesize(uint dev)
+{
+  return dev < NIDE ? disksize[dev] : 0;
+}
+
+// Stripe dev over dev2 by segment, or stop striping it if dev2 is 0.
+// Returns -1 if dev2 is not there.
+int
+idestripe(uint dev, uint dev2)
+{
+  if(dev >= NIDE || dev2 >= NIDE || dev2 == dev || (dev2 && !havedisk[dev2]))
+    return -1;
+  stripe[dev] = dev2;
+  return 0;
+}
+
+// The disk holding b, and the sector it starts at there.
+static uint
+idemap(struct buf *b, uint *sector)
+{
+  uint dev, blk, s;
+
+  dev = b->dev;
+  blk = b->block;
+  if(stripe[dev] && blk >= SEGSTART){
+    s = B2SEG(blk);
+    blk = SEG2B(s >> 1) + (blk - SEG2B(s));
+    if(s & 1)
+      dev = stripe[dev];
+  }
+  if(sector)
+    *sector = B2S(blk);
+  return dev;
+}
+
+// Where b sorts in its channel's queues: drive, then sector.
+static uint
+idekey(struct buf *b)
+{
+  uint sector;
+
+  return (idemap(b, &sector) & 1) << 28 | sector;
+}
+
+// The active run's next sector has moved.
 static void
-idestart(struct buf *b)
+idexfer(struct idechan *c)
 {
+  c->left--;
+  if(++c->xsect == SPB){
+    c->xsect = 0;
+    c->xbuf = c->xbuf->qnext;
+  }
+}
+
+// Start the run of n bufs from b, which are for consecutive sectors.
+// Caller must hold c->lock.
+static void
+idestart(struct idechan *c, struct buf *b, int n)
+{
+  uint dev, sector;
+
   if(b == 0)
     panic("idestart");
 
-  uint sector = B2S(b->block);
-
-  idewait(0);
-  outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, SPB);  // number of sectors
-  outb(0x1f3, sector & 0xff);
-  outb(0x1f4, (sector >> 8) & 0xff);
-  outb(0x1f5, (sector >> 16) & 0xff);
-  outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
+  dev = idemap(b, &sector);
+  idewait(c, 0);
+  // interrupts, unless a waiter is polling
+  c->quiet = c->polling;
+  outb(c->ctl, c->polling ? 2 : 0);
+  outb(c->base+2, n*SPB);  // number of sectors
+  outb(c->base+3, sector & 0xff);
+  outb(c->base+4, (sector >> 8) & 0xff);
+  outb(c->base+5, (sector >> 16) & 0xff);
+  outb(c->base+6, 0xe0 | ((dev&1)<<4) | ((sector>>24)&0x0f));
+  lfsstat.idecmds++;
+  c->xbuf = b;
+  c->xsect = 0;
+  c->left = n*SPB;
   if(b->flags & B_DIRTY){
-    outb(0x1f7, IDE_CMD_WRITE);
-    outsl(0x1f0, b->data, BSIZE/4);
+    outb(c->base+7, IDE_CMD_WRITE);
+    // the rest go one per interrupt, from idedone
+    if(idedrq(c) >= 0)
+      outsl(c->base, b->data, 512/4);
+    idexfer(c);
   } else {
-    outb(0x1f7, IDE_CMD_READ);
+    outb(c->base+7, IDE_CMD_READ);
+  }
+}
+
+// Start the next run, if anything is waiting.  Caller must hold
+// c->lock and the channel must be idle.
+static void
+idenext(struct idechan *c)
+{
+  struct buf **q, **pp, *b, *last;
+  int n;
+
+  if(c->reads && (c->writes == 0 || c->nreads < IDE_READBURST)){
+    q = &c->reads;
+    c->nreads = c->writes ? c->nreads + 1 : 0;
+  } else if(c->writes){
+    q = &c->writes;
+    c->nreads = 0;
+  } else
+    return;
+
+  // first request at or past the end of the last run, or the lowest
+  for(pp = q; *pp && idekey(*pp) < c->pos; pp = &(*pp)->qnext)
+    ;
+  if(*pp == 0)
+    pp = q;
+
+  // and the ones that continue it on the disk, in the same direction
+  b = *pp;
+  n = 1;
+  for(last = b; last->qnext && (n+1)*SPB <= IDE_MAXSECT; last = last->qnext, n++)
+    if(idekey(last->qnext) != idekey(last) + SPB ||
+       (last->qnext->flags & B_DIRTY) != (b->flags & B_DIRTY))
+      break;
+  *pp = last->qnext;
+  last->qnext = 0;
+  c->active = b;
+  c->pos = idekey(last) + SPB;
+  idestart(c, b, n);
+}
+
+// Add b to its queue in c, after any request for the same sector.
+// A read of a sector with a write waiting goes behind the write.
+// Caller must hold c->lock.
+static void
+idequeue(struct idechan *c, struct buf *b)
+{
+  struct buf **q, **pp, *w;
+  uint key;
+
+  key = idekey(b);
+  q = b->flags & B_DIRTY ? &c->writes : &c->reads;
+  if(q == &c->reads)
+    for(w = c->writes; w; w = w->qnext)
+      if(idekey(w) == key)
+        q = &c->writes;
+  for(pp = q; *pp && idekey(*pp) <= key; pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+// Move the active run of c along.  The disk interrupts once per
+// sector: for a read when the sector is ready to take in, for a write
+// when it wants the next one, and once more after a write's last.  So
+// each call moves a single sector, which keeps the time spent here
+// with the lock held short however long the run is.  Once the run is
+// through, or the disk gave up on it, wake the processes waiting for
+// its bufs and tell whoever submitted them without waiting.  Returns
+// 1 then, 0 if the run is not finished.  Caller must hold c->lock.
+static int
+idedone(struct idechan *c)
+{
+  struct buf *b, *next;
+  int r;
+
+  if((b = c->active) == 0 || ((r = inb(c->base+7)) & IDE_BSY))
+    return 0;
+
+  if(c->left > 0){
+    if(r & (IDE_DF|IDE_ERR))
+      c->left = 0;  // aborted: finish the run as it is
+    else if(r & IDE_DRQ){
+      if(b->flags & B_DIRTY)
+        outsl(c->base, c->xbuf->data + c->xsect*512, 512/4);
+      else
+        insl(c->base, c->xbuf->data + c->xsect*512, 512/4);
+      idexfer(c);
+      if(c->left > 0 || (b->flags & B_DIRTY))
+        return 0;
+    } else
+      return 0;  // not ready yet
+  }
+
+  for(b = c->active; b; b = next){
+    next = b->qnext;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+    if(b->done)
+      b->done(b);
   }
+  c->active = 0;
+  return 1;
 }
 
-// Interrupt handler.
+// Interrupt handler for channel n.
 void
-ideintr(void)
+ideintr(int n)
+{
+  struct idechan *c = &chans[n];
+
+  acquire(&c->lock);
+  // Start disk on the next run.
+  if(idedone(c))
+    idenext(c);
+  // else spurious, or part of a run
+  release(&c->lock);
+}
+
+// Buffers on c, running or waiting.
+static int
+idedepth(struct idechan *c)
 {
   struct buf *b;
+  int n;
 
-  // Take first buffer off queue.
-  acquire(&idelock);
-  if((b = idequeue) == 0){
-    release(&idelock);
-    // cprintf("spurious IDE interrupt\n");
+  n = 0;
+  for(b = c->active; b; b = b->qnext)
+    n++;
+  for(b = c->reads; b; b = b->qnext)
+    n++;
+  for(b = c->writes; b; b = b->qnext)
+    n++;
+  return n;
+}
+
+#define DONE(b) (((b)->flags & (B_VALID|B_DIRTY)) == B_VALID)
+
+// Wait for b, which is queued on c, by polling or by sleeping, and
+// time it.  Caller must hold c->lock.
+static void
+idewaitbuf(struct idechan *c, struct buf *b)
+{
+  uint64 t0;
+  uint cost, *avg;
+  int depth, poll;
+
+  if(DONE(b))
     return;
+  depth = idedepth(c);
+  poll = 0;
+  if(depth >= IDE_POLLDEPTH && !c->polling)
+    poll = (c->pollcost <= c->intrcost) != (++c->nprobe % IDE_PROBE == 0);
+  t0 = rdtsc();
+  if(poll){
+    c->polling = 1;
+    // keep on until no run is left that would never interrupt
+    while(!DONE(b) || (c->active && c->quiet)){
+      if(c->active == 0)
+        idenext(c);
+      // spin without the lock, so ideintr can finish a run that
+      // was started with interrupts on
+      release(&c->lock);
+      // give a command just started 400ns to raise BSY
+      inb(c->ctl); inb(c->ctl); inb(c->ctl); inb(c->ctl);
+      while(inb(c->base+7) & IDE_BSY)
+        ;
+      acquire(&c->lock);
+      idedone(c);
+    }
+    c->polling = 0;
+    if(c->active == 0)
+      idenext(c);
+    lfsstat.idepolls++;
+  } else {
+    // Assuming will not sleep too long: ignore proc->killed.
+    while(!DONE(b))
+      sleep(b, &c->lock);
+    lfsstat.idesleeps++;
   }
-  idequeue = b->qnext;
+  if(depth < IDE_POLLDEPTH)
+    return;
+  cost = (uint)(rdtsc() - t0) / depth;  // a wait is well under 2^32
+  avg = poll ? &c->pollcost : &c->intrcost;
+  *avg = *avg == 0 ? cost : (*avg * 7 + cost) / 8;
+  lfsstat.pollcost = c->pollcost;
+  lfsstat.intrcost = c->intrcost;
+}
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
-  
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
-  
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+// Has the disk had nothing to do for n ticks?
+int
+ideidle(uint n)
+{
+  int i, idle;
 
-  release(&idelock);
+  idle = ticks - idelast >= n;
+  for(i = 0; i < 2; i++){
+    acquire(&chans[i].lock);
+    idle = idle && chans[i].active == 0 && chans[i].reads == 0 &&
+      chans[i].writes == 0;
+    release(&chans[i].lock);
+  }
+  return idle;
 }
 
-// Sync buf with disk. 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Queue bufs for the disk, as iderw does, without waiting.  Each
+// is marked done and woken up like any other, then done(b) is called
+// if done is not 0.  It runs in ideintr with the channel locked, so
+// it must not sleep.  Queuing them all at once lets requests for
+// different channels overlap and requests for neighbouring sectors
+// merge.
 void
-iderw(struct buf *b)
+idesubmit(struct buf **bs, int n, void (*done)(struct buf*))
 {
-  struct buf **pp;
+  struct idechan *c;
+  struct buf *b;
+  int i;
 
-  if(!(b->flags & B_BUSY))
-    panic("iderw: buf not busy");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    if(!(b->flags & B_BUSY))
+      panic("iderw: buf not busy");
+    if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+    if(!havedisk[idemap(b, 0)])
+      panic("iderw: ide disk not present");
+  }
 
-  acquire(&idelock);
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    c = &chans[idemap(b, 0) >> 1];
+    acquire(&c->lock);
+    idelast = ticks;
+    lfsstat.idereqs++;
+    b->done = done;
+    idequeue(c, b);
+    // the rest of bs may join the run, so start the disk after the
+    // last of them for this channel
+    if(c->active == 0 && (i == n-1 || idemap(bs[i+1], 0) >> 1 != c - chans))
+      idenext(c);
+    release(&c->lock);
+  }
+}
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)
-    ;
-  *pp = b;
-  
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
-  
-  // Wait for request to finish.
-  // Assuming will not sleep too long: ignore proc->killed.
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+// Sync bufs with disk: each as iderw does, all queued before any
+// is waited for.
+void
+iderwv(struct buf **bs, int n)
+{
+  struct idechan *c;
+  struct buf *b;
+  int i;
+
+  idesubmit(bs, n, 0);
+
+  // Wait for requests to finish.
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    c = &chans[idemap(b, 0) >> 1];
+    acquire(&c->lock);
+    idewaitbuf(c, b);
+    release(&c->lock);
   }
+}
 
-  release(&idelock);
+// Sync buf with disk. 
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  iderwv(&b, 1);
 }
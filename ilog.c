@@ -0,0 +1,235 @@
+// Intent log for fsync.
+//
+// A volume whose superblock names an intent log disk (mkfs -l) can
+// make a file durable without flushing its log heads, which would
+// write a partial segment per fsync.  Instead fsync writes the file's
+// changed blocks to the intent log as one record and waits for just
+// that.  The log heads pick the same blocks up at their next flush.
+//
+// Records carry the generation they were written in.  Each flush of
+// the log heads starts a new one (ilogcut), and the flush's last
+// summary records the generation it absorbed, so does the superblock
+// at a checkpoint.  At mount, records of later generations are
+// replayed on top of the rolled-forward log.  Generations alternate
+// between the two halves of the disk: while a flush is absorbing one,
+// fsync fills the next, and by the time that is cut the one before
+// is on disk in the log.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "fs.h"
+
+struct {
+  struct spinlock lock;
+  int busy; // a record is being written or replayed
+  int replaying;
+  uint dev; // intent log disk, 0 if there is none
+  uint fsdev; // the volume it is for
+  uint half; // blocks in each half
+  uint gen; // generation being written
+  uint next[2]; // next record in each half, from its first block
+  // record and data staging, guarded by busy
+  struct buf rec;
+  struct buf data[NDIRECT];
+  uchar recdata[BSIZE];
+  uchar blocks[NDIRECT][BSIZE];
+  struct buf *io[NDIRECT + 1];
+} ilog;
+
+// Block k of half h.
+#define ILOGBLOCK(h, k) (2 + (h) * ilog.half + (k))
+
+// Does dev have an intent log?
+int
+ilogon(uint dev)
+{
+  return ilog.dev != 0 && ilog.fsdev == dev;
+}
+
+// Start a new generation of records, for a flush of dev's log heads
+// that takes in everything written so far.  Returns the generation
+// the flush absorbs, or last if dev has no intent log.
+uint
+ilogcut(uint dev, uint last)
+{
+  uint gen;
+
+  if (!ilogon(dev))
+    return last;
+  acquire(&ilog.lock);
+  // records being replayed are not in the log heads yet
+  if (ilog.replaying) {
+    release(&ilog.lock);
+    return last;
+  }
+  gen = ilog.gen++;
+  ilog.next[ilog.gen % 2] = 0;
+  release(&ilog.lock);
+  return gen;
+}
+
+static void
+ilogwait(void)
+{
+  acquire(&ilog.lock);
+  while (ilog.busy)
+    sleep(&ilog, &ilog.lock);
+  ilog.busy = 1;
+  release(&ilog.lock);
+}
+
+static void
+ilogdone(void)
+{
+  acquire(&ilog.lock);
+  ilog.busy = 0;
+  wakeup(&ilog);
+  release(&ilog.lock);
+}
+
+// Write a record for inode inum of dev: its size, what happened to
+// each direct block, and the n blocks marked ILOG_DATA in order.
+// Returns -1 if the log has no room; the caller flushes instead.
+int
+ilogwrite(uint dev, uint inum, uint size, uchar *state, struct buf **data, int n)
+{
+  struct ilog_record *r = (struct ilog_record *)ilog.rec.data;
+  uint h, k;
+  int i;
+
+  if (!ilogon(dev))
+    return -1;
+  ilogwait();
+  acquire(&ilog.lock);
+  h = ilog.gen % 2;
+  if (ilog.next[h] + 1 + n > ilog.half) {
+    release(&ilog.lock);
+    ilogdone();
+    return -1;
+  }
+  k = ilog.next[h];
+  ilog.next[h] += 1 + n;
+  memset(r, 0, BSIZE);
+  r->gen = ilog.gen;
+  release(&ilog.lock);
+
+  r->magic = ILOGMAGIC;
+  r->inum = inum;
+  r->size = size;
+  r->n = n;
+  memmove(r->state, state, NDIRECT);
+  for (i = 0; i < n; i++) {
+    memmove(ilog.data[i].data, data[i]->data, BSIZE);
+    r->datacrc = crc32c(r->datacrc, data[i]->data, BSIZE);
+  }
+  r->crc = crc32c(0, r, sizeof(*r));
+  for (i = 0; i <= n; i++) {
+    ilog.io[i] = i == 0 ? &ilog.rec : &ilog.data[i-1];
+    ilog.io[i]->dev = ilog.dev;
+    ilog.io[i]->block = ILOGBLOCK(h, k + i);
+    ilog.io[i]->flags = B_BUSY | B_DIRTY;
+  }
+  iderwv(ilog.io, n + 1);
+  lfsstat.devbytes += (n + 1) * BSIZE;
+  ilogdone();
+  return 0;
+}
+
+// Read the record at block k of half h into ilog.rec and its data
+// into ilog.data.  Returns 1 if it is a whole record of generation gen.
+static int
+ilogread(uint h, uint k, uint gen)
+{
+  struct ilog_record *r = (struct ilog_record *)ilog.rec.data;
+  uint crc;
+  int i;
+
+  if (k >= ilog.half)
+    return 0;
+  ilog.rec.dev = ilog.dev;
+  ilog.rec.block = ILOGBLOCK(h, k);
+  ilog.rec.flags = B_BUSY;
+  iderw(&ilog.rec);
+  crc = r->crc;
+  r->crc = 0;
+  if (r->magic != ILOGMAGIC || crc32c(0, r, sizeof(*r)) != crc ||
+      r->gen != gen || r->n > NDIRECT || k + 1 + r->n > ilog.half)
+    return 0;
+  for (i = 0; i < r->n; i++) {
+    ilog.io[i] = &ilog.data[i];
+    ilog.data[i].dev = ilog.dev;
+    ilog.data[i].block = ILOGBLOCK(h, k + 1 + i);
+    ilog.data[i].flags = B_BUSY;
+  }
+  iderwv(ilog.io, r->n);
+  crc = 0;
+  for (i = 0; i < r->n; i++)
+    crc = crc32c(crc, ilog.data[i].data, BSIZE);
+  return crc == r->datacrc;
+}
+
+// Replay the records of generation gen.  Returns how many there were.
+static int
+ilogreplay(uint gen)
+{
+  struct ilog_record *r = (struct ilog_record *)ilog.rec.data;
+  uint k;
+  int n;
+
+  n = 0;
+  for (k = 0; ilogread(gen % 2, k, gen); k += 1 + r->n) {
+    ireplay(ilog.fsdev, r->inum, r->size, r->state, ilog.io);
+    n++;
+  }
+  return n;
+}
+
+// Open the intent log of volume dev, if it has one, and replay what
+// its log heads had not absorbed.  Called once the log has been
+// rolled forward.
+void
+iloginit(uint dev, struct disk_superblock *sb)
+{
+  struct ilog_header *hdr;
+  int n;
+
+  if (sb->ilog == 0)
+    return;
+  initlock(&ilog.lock, "ilog");
+  ilog.rec.data = ilog.recdata;
+  for (n = 0; n < NDIRECT; n++)
+    ilog.data[n].data = ilog.blocks[n];
+  hdr = (struct ilog_header *)ilog.rec.data;
+  ilog.rec.dev = sb->ilog;
+  ilog.rec.block = 1;
+  ilog.rec.flags = B_BUSY;
+  if (idesize(sb->ilog) == 0)
+    panic("iloginit: disk missing");
+  iderw(&ilog.rec);
+  if (hdr->magic != ILOGMAGIC || B2S(hdr->nblocks) > idesize(sb->ilog) ||
+      hdr->nblocks < 2 + 2 * (1 + NDIRECT))
+    panic("iloginit: header");
+  ilog.half = (hdr->nblocks - 2) / 2;
+  ilog.dev = sb->ilog;
+  ilog.fsdev = dev;
+
+  // the two generations after the absorbed one may both have records
+  ilog.busy = 1;
+  ilog.replaying = 1;
+  n = ilogreplay(sb->ilgen + 1);
+  n += ilogreplay(sb->ilgen + 2);
+  acquire(&ilog.lock);
+  ilog.gen = sb->ilgen + 3;
+  ilog.next[0] = ilog.next[1] = 0;
+  ilog.replaying = 0;
+  release(&ilog.lock);
+  // the halves are reused from here, so get the replay into the log
+  if (n > 0) {
+    cprintf("ilog: replayed %d records\n", n);
+    bcheckpoint(dev);
+  }
+  ilogdone();
+}
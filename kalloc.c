@@ -1,6 +1,7 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// pipe buffers and the buffer cache. Allocates 4096-byte pages.
+// When none are free, the buffer cache is asked for one back.
 
 #include "types.h"
 #include "defs.h"
@@ -15,6 +16,7 @@ struct run {
 struct {
   struct spinlock lock;
   struct run *freelist;
+  uint nfree; // pages on freelist
 } kmem;
 
 extern char end[]; // first address after kernel loaded from ELF file
@@ -50,6 +52,7 @@ kfree(char *v)
   r = (struct run*)v;
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   release(&kmem.lock);
 }
 
@@ -61,11 +64,22 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  do {
+    acquire(&kmem.lock);
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+    }
+    release(&kmem.lock);
+  } while(r == 0 && bshrink());
   return (char*)r;
 }
 
+// Number of free pages, for sizing the buffer cache.
+uint
+kfreepages(void)
+{
+  return kmem.nfree;
+}
+
@@ -0,0 +1,63 @@
+// print segment cleaning and write amplification counters;
+// "lfsstat -d n" sizes the dedup index first (0 turns it off), and
+// "lfsstat -p greedy|costbenefit" picks the cleaning policy
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct lfsstat st;
+  uint wa, n;
+
+  if(argc == 3 && strcmp(argv[1], "-d") == 0)
+    printf(1, "dedup index %d entries, was %d\n", atoi(argv[2]), dedup(atoi(argv[2])));
+  if(argc == 3 && strcmp(argv[1], "-p") == 0 &&
+     lfspolicy(strcmp(argv[2], "greedy") == 0 ? CLEAN_GREEDY :
+               strcmp(argv[2], "costbenefit") == 0 ? CLEAN_COSTBENEFIT : -1) < 0)
+    printf(2, "lfsstat: unknown cleaning policy %s\n", argv[2]);
+
+  if(lfsstat(&st) < 0){
+    printf(2, "lfsstat: failed\n");
+    exit();
+  }
+  printf(1, "policy %s\n", st.policy == CLEAN_GREEDY ? "greedy" : "costbenefit");
+  printf(1, "segments %d clean of %d, %d KB of %d-byte blocks each\n", st.nclean,
+         st.nsegs, st.segblocks * st.bsize / 1024, st.bsize);
+  printf(1, "cleaned %d segments, moved %d blocks\n", st.cleaned, st.moved);
+  printf(1, "user %d KB, device %d KB\n", st.userbytes / 1024, st.devbytes / 1024);
+  if(st.userbytes >= 1024){
+    // hundredths, in KB so the product does not overflow
+    wa = (st.devbytes / 1024) * 100 / (st.userbytes / 1024);
+    printf(1, "write amplification %d.%d%d\n", wa / 100, wa / 10 % 10, wa % 10);
+  }
+  if(st.zout >= 1024){
+    wa = (st.zin / 1024) * 100 / (st.zout / 1024);
+    printf(1, "compressed %d KB to %d KB, ratio %d.%d%d\n", st.zin / 1024,
+           st.zout / 1024, wa / 100, wa / 10 % 10, wa % 10);
+  }
+  if(st.dedupchecked > 0){
+    wa = st.deduphits * 1000 / st.dedupchecked;
+    printf(1, "dedup %d of %d blocks, hit rate %d.%d%%\n", st.deduphits,
+           st.dedupchecked, wa / 10, wa % 10);
+  }
+  if(st.idecmds > 0){
+    wa = st.idereqs * 100 / st.idecmds;
+    printf(1, "disk %d requests in %d commands, %d.%d%d per command\n", st.idereqs,
+           st.idecmds, wa / 100, wa / 10 % 10, wa % 10);
+  }
+  if(st.idepolls > 0)
+    printf(1, "disk %d waits polled at %d cycles per buffer, %d slept at %d\n",
+           st.idepolls, st.pollcost, st.idesleeps, st.intrcost);
+  if(st.bhits + st.bmisses > 0){
+    n = st.bhits + st.bmisses;
+    wa = n < 4000000 ? st.bhits * 1000 / n : st.bhits / (n / 1000);
+    printf(1, "cache %d buffers, %d hits of %d lookups, hit rate %d.%d%%, %d misses were ghosts\n",
+           st.nbuf, st.bhits, n, wa / 10, wa % 10, st.bghosts);
+  }
+  if(st.bclustered > 0)
+    printf(1, "cache %d blocks read along with misses\n", st.bclustered);
+  exit();
+}
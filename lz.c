@@ -0,0 +1,158 @@
+// LZ4-style block compression for the segment writer.
+//
+// The format is LZ4's block format: a run of sequences, each a token
+// byte (literal count in the high nibble, match length - 4 in the
+// low), extra length bytes for either nibble that is 15, the
+// literals, then a 2-byte little-endian match offset.  The last
+// sequence has literals only.  Matches are found through a hash of
+// the next 4 bytes with one candidate per bucket, which keeps the
+// compressor cheap enough to run inline.  Blocks are at most 64KB.
+
+#include "types.h"
+#include "defs.h"
+
+#define HASHBITS 10
+#define MINMATCH 4
+#define LASTLITERALS 5  // the last bytes of a block are always literals
+#define MFLIMIT 12      // no match starts this close to the end
+
+// positions by hash, guarded by the segment writer's zlock
+static ushort table[1 << HASHBITS];
+
+static uint
+hash(const uchar *p)
+{
+  uint v;
+
+  v = p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+  return (v * 2654435761U) >> (32 - HASHBITS);
+}
+
+// Emit the extension bytes of a length whose nibble is 15.
+static uchar*
+putlen(uchar *op, uint n)
+{
+  for(; n >= 255; n -= 255)
+    *op++ = 255;
+  *op++ = n;
+  return op;
+}
+
+// Emit a sequence: lit literals from anchor, then a match of len
+// bytes at offset off if len is not 0.  Returns 0 if it would run
+// past oend.
+static uchar*
+putseq(uchar *op, uchar *oend, const uchar *anchor, uint lit, uint off, uint len)
+{
+  uchar *tok;
+
+  if(op + 1 + lit/255 + 1 + lit + 2 + len/255 + 1 > oend)
+    return 0;
+  tok = op++;
+  *tok = (lit >= 15 ? 15 : lit) << 4;
+  if(lit >= 15)
+    op = putlen(op, lit - 15);
+  memmove(op, anchor, lit);
+  op += lit;
+  if(len == 0)
+    return op;
+  *op++ = off & 0xff;
+  *op++ = off >> 8;
+  len -= MINMATCH;
+  *tok |= len >= 15 ? 15 : len;
+  if(len >= 15)
+    op = putlen(op, len - 15);
+  return op;
+}
+
+// Compress the n bytes at src into dst, which holds max bytes.
+// Returns the compressed length, or -1 if it does not fit.
+int
+lzcompress(const uchar *src, uint n, uchar *dst, uint max)
+{
+  const uchar *ip, *anchor, *ref, *end, *mlimit;
+  uchar *op, *oend;
+  uint h, len;
+
+  memset(table, 0, sizeof(table));
+  ip = anchor = src;
+  end = src + n;
+  mlimit = n > MFLIMIT ? end - MFLIMIT : src;
+  op = dst;
+  oend = dst + max;
+  while(ip < mlimit){
+    h = hash(ip);
+    ref = src + table[h];
+    table[h] = ip - src;
+    if(ref >= ip || ip - ref > 0xffff || memcmp(ref, ip, MINMATCH) != 0){
+      ip++;
+      continue;
+    }
+    for(len = MINMATCH; ip + len < end - LASTLITERALS && ref[len] == ip[len]; len++)
+      ;
+    if((op = putseq(op, oend, anchor, ip - anchor, ip - ref, len)) == 0)
+      return -1;
+    ip += len;
+    anchor = ip;
+  }
+  if((op = putseq(op, oend, anchor, end - anchor, 0, 0)) == 0)
+    return -1;
+  return op - dst;
+}
+
+// Read the extension bytes of a length whose nibble is 15.
+// Returns 0 if they run past end.
+static const uchar*
+getlen(const uchar *ip, const uchar *end, uint *n)
+{
+  do {
+    if(ip >= end)
+      return 0;
+    *n += *ip;
+  } while(*ip++ == 255);
+  return ip;
+}
+
+// Expand the n bytes at src into dst, which holds max bytes.
+// Returns the expanded length, or -1 if src is corrupt.
+int
+lzdecompress(const uchar *src, uint n, uchar *dst, uint max)
+{
+  const uchar *ip, *end, *ref;
+  uchar *op, *oend;
+  uint tok, len, off;
+
+  ip = src;
+  end = src + n;
+  op = dst;
+  oend = dst + max;
+  while(ip < end){
+    tok = *ip++;
+    len = tok >> 4;
+    if(len == 15 && (ip = getlen(ip, end, &len)) == 0)
+      return -1;
+    if(len > end - ip || len > oend - op)
+      return -1;
+    memmove(op, ip, len);
+    op += len;
+    ip += len;
+    if(ip == end)
+      break;
+    if(end - ip < 2)
+      return -1;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if(off == 0 || off > op - dst)
+      return -1;
+    len = tok & 15;
+    if(len == 15 && (ip = getlen(ip, end, &len)) == 0)
+      return -1;
+    len += MINMATCH;
+    if(len > oend - op)
+      return -1;
+    // the match may overlap what it produces
+    for(ref = op - off; len > 0; len--)
+      *op++ = *ref++;
+  }
+  return op - dst;
+}
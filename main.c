@@ -56,6 +56,7 @@ mainc(void)
   if(!ismp)
     timerinit();   // uniprocessor timer
   userinit();      // first user process
+  cleanerinit();   // background segment cleaner
   bootothers();    // start other processors
 
   // Finish setting up this processor in mpmain.
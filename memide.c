@@ -0,0 +1,113 @@
+// RAM disk in place of ide.c, for kernelmemfs.
+//
+// The root's image is linked into the kernel (ld -b binary) and
+// requests are served by copying to and from it, at once, so the
+// file system's own CPU cost can be measured without the emulated
+// disk's.  There is only the root disk: no stripe, intent log or
+// second volume.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "fs.h"
+
+extern uchar _binary_fsmem_img_start[], _binary_fsmem_img_size[];
+
+static struct spinlock memlock;
+static uchar *memdisk;
+static uint disksize;  // sectors
+static uint memlast;   // ticks at the last request
+
+void
+ideinit(void)
+{
+  initlock(&memlock, "memdisk");
+  memdisk = _binary_fsmem_img_start;
+  disksize = (uint)_binary_fsmem_img_size / 512;
+}
+
+// Size of disk dev in sectors, or 0 if there is no such disk.
+uint
+idesize(uint dev)
+{
+  return dev == ROOTDEV ? disksize : 0;
+}
+
+// There is no second disk to stripe over.
+int
+idestripe(uint dev, uint dev2)
+{
+  return dev2 == 0 ? 0 : -1;
+}
+
+// No interrupts are enabled, so this is never called.
+void
+ideintr(int n)
+{
+}
+
+// Has the disk had nothing to do for n ticks?
+int
+ideidle(uint n)
+{
+  return ticks - memlast >= n;
+}
+
+// Serve bufs from memory, then mark them done as ideintr would.
+void
+idesubmit(struct buf **bs, int n, void (*done)(struct buf*))
+{
+  struct buf *b;
+  uchar *p;
+  int i;
+
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    if(!(b->flags & B_BUSY))
+      panic("iderw: buf not busy");
+    if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+    if(b->dev != ROOTDEV)
+      panic("iderw: request not for disk 1");
+    if(B2S(b->block) + SPB > disksize)
+      panic("iderw: block out of range");
+  }
+
+  acquire(&memlock);
+  memlast = ticks;
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    p = memdisk + B2S(b->block)*512;
+    if(b->flags & B_DIRTY)
+      memmove(p, b->data, BSIZE);
+    else
+      memmove(b->data, p, BSIZE);
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    lfsstat.idereqs++;
+    lfsstat.idecmds++;
+    wakeup(b);
+    b->done = done;
+    if(done)
+      done(b);
+  }
+  release(&memlock);
+}
+
+// Sync bufs with memory.  Nothing is left to wait for.
+void
+iderwv(struct buf **bs, int n)
+{
+  idesubmit(bs, n, 0);
+}
+
+// Sync buf with memory.
+// If B_DIRTY is set, write buf to memory, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from memory, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  iderwv(&b, 1);
+}
@@ -18,20 +18,36 @@
 #define stat xv6_stat  // avoid clash with host struct stat
 #include "stat.h"
 
+// 0-512 is boot sector
+#define FLOC(a) (B2S(a) * 512)
+
 // global variables
 int fsd;
+int stripefd = -1; // -2: odd segments go to a second image
+int ilogfd = -1; // -l: the intent log's image
 struct disk_superblock sb;
 
 block_t imap[MAX_INODES];
-static block_t cur_block = 1 + SEGMETABLOCKS; // 0 for superblock
+static block_t seg_start = SEGSTART; // summary of the current segment
+static block_t cur_block = SEGSTART + SEGMETABLOCKS; // 1 for superblock
 static inode_t cur_inode = 1; // inode 0 means null
 static uint seg_block = 0;
+static struct seg_entry seg_entries[PARTBLOCKS]; // owners for the summary
+uint segblocks = SEGSIZE / BSIZE; // -g
+
+static uint nsegs = 0; // size of the image, -s
+#define FREESEGS 20 // default: empty segments after the ones mkfs fills
 
 // block funcs
-block_t balloc(void);
+block_t balloc(inode_t, uint);
+void bread(block_t, void *);
 void bwrite(block_t, const void *);
-block_t data_block(block_t *, uint);
-void seg_finish(block_t);
+block_t data_block(inode_t, block_t *, uint);
+int bimage(block_t *);
+int zeroes(const char *, uint);
+void seg_finish(void);
+void seg_crcs(void);
+uint crc32c(uint, const void *, uint);
 
 // inode funcs
 inode_t ialloc(short);
@@ -44,9 +60,52 @@ int main(int argc, char * argv[])
 	bzero(&sb, sizeof(sb));
 	sb.nsegs = 0;
 	sb.segment = 0;
+	sb.policy = CLEAN_COSTBENEFIT;
+	sb.bsize = BSIZE;
+
+	while (argc > 2 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-c") == 0) {
+			if (strcmp(argv[2], "greedy") == 0)
+				sb.policy = CLEAN_GREEDY;
+			else if (strcmp(argv[2], "costbenefit") != 0) {
+				printf("mkfs: unknown cleaning policy %s\n", argv[2]);
+				exit(1);
+			}
+		} else if (strcmp(argv[1], "-s") == 0)
+			nsegs = atoi(argv[2]);
+		else if (strcmp(argv[1], "-g") == 0) {
+			segblocks = atoi(argv[2]) * 1024 / BSIZE;
+			if (segblocks <= SEGMETABLOCKS || segblocks > MAXSEGBLOCKS) {
+				printf("mkfs: segments must be 2 to %d blocks of %d bytes\n", MAXSEGBLOCKS, BSIZE);
+				exit(1);
+			}
+		} else if (strcmp(argv[1], "-2") == 0) {
+			stripefd = open(argv[2], O_RDWR|O_CREAT|O_TRUNC, 0666);
+			if (stripefd < 0) {
+				perror(argv[2]);
+				exit(1);
+			}
+			sb.stripe = STRIPEDEV;
+		} else if (strcmp(argv[1], "-l") == 0) {
+			ilogfd = open(argv[2], O_RDWR|O_CREAT|O_TRUNC, 0666);
+			if (ilogfd < 0) {
+				perror(argv[2]);
+				exit(1);
+			}
+			sb.ilog = ILOGDEV;
+		} else
+			break;
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (stripefd >= 0 && ilogfd >= 0) {
+		printf("mkfs: the stripe and the intent log both need disk %d\n", STRIPEDEV);
+		exit(1);
+	}
 
 	if (argc < 2) {
-		printf("Usage: mkfs [image file] [input files...]\n");
+		printf("Usage: mkfs [-c greedy|costbenefit] [-s segments] [-g segment KB] [-2 stripe image] [-l intent log image] [image file] [input files...]\n");
 		exit(1);
 	}
 
@@ -96,79 +155,163 @@ int main(int argc, char * argv[])
 		close(fd);
 	}
 	
-	block_t imap_block = balloc();
+	block_t imap_block = balloc(0, BN_IMAP);
 	bwrite(imap_block, imap);
 	
 	char buf[BSIZE];
 	bzero(buf, BSIZE);
 
 	sb.imap = imap_block;
-	sb.nblocks = cur_block;
 	sb.ninodes = cur_inode;
-	sb.next = cur_block;
 
+	if (seg_block != 0)
+		seg_finish();
+	seg_crcs();
+
+	// the rest of this segment belongs to the hot head;
+	// the cold head starts out in a segment of its own
+	sb.nblocks = seg_start;
+	sb.head[HEAD_HOT] = seg_start;
+	sb.head[HEAD_COLD] = SEG2B(B2SEG(seg_start) + 1);
+	// the kernel sizes the log from the disk; this only sizes the image
+	sb.nsegs = B2SEG(seg_start) + 1 + FREESEGS;
+	if (nsegs != 0) {
+		if (nsegs < B2SEG(seg_start) + 2) {
+			printf("mkfs: %d segments is too small\n", nsegs);
+			exit(1);
+		}
+		sb.nsegs = nsegs;
+	}
+
+	sb.segblocks = segblocks;
 	memcpy(buf, &sb, sizeof(sb));
 	bwrite(1, buf);
 
-	if (seg_block != 0)
-		seg_finish(sb.segment + SEGBLOCKS); 
-
-	// expand the drive image by a bit over 20 segments
+	// expand the drive image to whole segments
 	bzero(buf, BSIZE);
-	uint k;
-	for (k = 0; k < SEGBLOCKS * 20 + 50; k++)
-		bwrite(cur_block + k, buf);
+	block_t k;
+	for (k = seg_start; k < SEG2B(sb.nsegs); k++)
+		bwrite(k, buf);
 
 	close(fsd);
+	if (stripefd >= 0)
+		close(stripefd);
+	if (ilogfd >= 0) {
+		// a header, then two empty halves
+		struct ilog_header * hdr = (struct ilog_header *)buf;
+		bzero(buf, BSIZE);
+		hdr->magic = ILOGMAGIC;
+		hdr->nblocks = ILOGBLOCKS;
+		for (k = 1; k < ILOGBLOCKS; k++) {
+			assert(lseek(ilogfd, FLOC(k), SEEK_SET) == FLOC(k));
+			assert(write(ilogfd, buf, BSIZE) == BSIZE);
+			bzero(buf, BSIZE);
+		}
+		close(ilogfd);
+	}
 
 	return 0;
 }
 
-void seg_finish(block_t start)
+// write the summary for the blocks allocated since seg_start
+// and start the next partial segment after them.  the blocks are
+// only handed out here, so seg_crcs() checksums them at the end
+void seg_finish(void)
 {
-	char zeroes[BSIZE];
-	bzero(zeroes, BSIZE);
+	char buf[BSIZE];
+	struct seg_summary * sum = (struct seg_summary *)buf;
+	block_t end = SEG2B(B2SEG(seg_start) + 1);
+	uint k;
 
+	bzero(buf, BSIZE);
+	for (k = 1; k < SEGMETABLOCKS; k++)
+		bwrite(seg_start + k, buf);
+
+	sum->magic = SUMMAGIC;
+	sum->serial = ++sb.serial;
+	sum->nblocks = seg_block;
+	sum->next = seg_start + SEGMETABLOCKS + seg_block;
+	if (sum->next + SEGMETABLOCKS >= end)
+		sum->next = end;
+	sum->imap = sb.imap;
+	sum->ninodes = cur_inode;
+	memcpy(sum->entries, seg_entries, seg_block * sizeof(seg_entries[0]));
+	bwrite(seg_start, buf);
+
+	if (sum->next == end)
+		sb.segment = seg_start;
+
+	seg_start = sum->next;
+	cur_block = seg_start + SEGMETABLOCKS;
+	seg_block = 0;
+}
+
+// checksum every partial segment's data, now that it is final,
+// and then its summary
+void seg_crcs(void)
+{
+	char buf[BSIZE], data[BSIZE];
+	struct seg_summary * sum = (struct seg_summary *)buf;
+	block_t a;
 	uint k;
-	for (k = 0; k < SEGMETABLOCKS; k++)
-		bwrite(start + k, zeroes);
+
+	for (a = SEGSTART; a != seg_start; a = sum->next) {
+		bread(a, buf);
+		sum->datacrc = 0;
+		for (k = 0; k < sum->nblocks; k++) {
+			bread(a + SEGMETABLOCKS + k, data);
+			sum->datacrc = crc32c(sum->datacrc, data, BSIZE);
+		}
+		sum->sumcrc = 0;
+		sum->sumcrc = crc32c(0, sum, sizeof(*sum));
+		bwrite(a, buf);
+	}
 }
 
-block_t balloc(void)
+// allocate a block for block bn of inode inum (or one of the BN_ kinds)
+block_t balloc(inode_t inum, uint bn)
 {
 	char zeroes[BSIZE];
 	bzero(zeroes, BSIZE);
 
 	block_t bret = cur_block++;
 	bwrite(bret, zeroes);
+	seg_entries[seg_block].inum = inum;
+	seg_entries[seg_block].bn = bn;
+	seg_block++;
 
-	// segment is full.
-	if (++seg_block == SEGDATABLOCKS) {
-		seg_block = 0;
-		sb.segment = cur_block - SEGDATABLOCKS;
-		sb.nsegs++;
-
-		seg_finish(sb.segment);
-
-		cur_block += SEGMETABLOCKS;
-	}
+	// segment or summary is full.
+	if (cur_block == SEG2B(B2SEG(seg_start) + 1) || seg_block == PARTBLOCKS)
+		seg_finish();
 
 	return bret;
 }
 
-// 0-512 is boot sector
-#define FLOC(a) (B2S(a) * 512)
+// the image holding addr, which becomes its address there; a striped
+// log keeps odd segments on the second image, as the kernel's ide.c
+int bimage(block_t * addr)
+{
+	uint s;
+
+	if (stripefd < 0 || *addr < SEGSTART)
+		return fsd;
+	s = B2SEG(*addr);
+	*addr = SEG2B(s / 2) + (*addr - SEG2B(s));
+	return s % 2 ? stripefd : fsd;
+}
 
 void bread(block_t addr, void * buf)
 {
-	assert(lseek(fsd, FLOC(addr), SEEK_SET) == FLOC(addr));
-	assert(read(fsd, buf, BSIZE) == BSIZE);
+	int fd = bimage(&addr);
+	assert(lseek(fd, FLOC(addr), SEEK_SET) == FLOC(addr));
+	assert(read(fd, buf, BSIZE) == BSIZE);
 }
 
 void bwrite(block_t addr, const void * data)
 {
-	assert(lseek(fsd, FLOC(addr), SEEK_SET) == FLOC(addr));
-	assert(write(fsd, data, BSIZE)  == BSIZE);
+	int fd = bimage(&addr);
+	assert(lseek(fd, FLOC(addr), SEEK_SET) == FLOC(addr));
+	assert(write(fd, data, BSIZE)  == BSIZE);
 }
 
 inode_t ialloc(short type)
@@ -184,7 +327,7 @@ inode_t ialloc(short type)
 	ip.nlink = 1;
 	ip.size = 0;
 
-	block_t nb = balloc();
+	block_t nb = balloc(cur_inode, BN_INODE);
 	char buf[BSIZE];
 	bzero(buf, BSIZE);
 
@@ -211,7 +354,7 @@ void iread(inode_t i, struct disk_inode * di)
 	memcpy(di, buf, sizeof(struct disk_inode));
 }
 
-block_t data_block(block_t * addrs, uint off)
+block_t data_block(inode_t i, block_t * addrs, uint off)
 {
 	const uint bn = off / BSIZE;
 	uint cnt = 0, level = 0;
@@ -225,10 +368,12 @@ block_t data_block(block_t * addrs, uint off)
 	uint addr_off = (level == 0 ? (off / BSIZE) : (level + NDIRECT - 1));
 
 	if (addrs[addr_off] == 0)
-		addrs[addr_off] = balloc();
+		addrs[addr_off] = balloc(i, level == 0 ? bn : BN_INDIRECT);
 
 	block_t bnext = addrs[addr_off];
 	block_t * level_addrs = malloc(BSIZE);
+	if (level > 0)
+		bread(bnext, level_addrs);
 	
 	uint l;
 	for (l = level; l > 0; l--) {
@@ -240,7 +385,7 @@ block_t data_block(block_t * addrs, uint off)
 		off = off % div;
 
 		if (level_addrs[n] == 0) {
-			level_addrs[n] = balloc();
+			level_addrs[n] = balloc(i, l == 1 ? bn : BN_INDIRECT);
 			bwrite(bnext, level_addrs);
 		}
 		bnext = level_addrs[n];
@@ -253,6 +398,15 @@ block_t data_block(block_t * addrs, uint off)
 }
 
 
+int zeroes(const char * p, uint n)
+{
+	while (n > 0 && *p == 0) {
+		p++;
+		n--;
+	}
+	return n == 0;
+}
+
 void iappend(inode_t i, void * data, uint len)
 {
 	char out[BSIZE];
@@ -266,11 +420,16 @@ void iappend(inode_t i, void * data, uint len)
 
 	while (wr < max) {
 		uint len  = MIN(BSIZE - wr % BSIZE, max - wr);
-		block_t db = data_block(di.addrs, wr);
 
-		bread(db, out);
-		memcpy(out + wr % BSIZE, data + data_off, len);
-		bwrite(db, out);
+		// past the old end everything reads as zeroes already, so
+		// zero runs are left as holes
+		if (!zeroes((char *)data + data_off, len)) {
+			block_t db = data_block(i, di.addrs, wr);
+
+			bread(db, out);
+			memcpy(out + wr % BSIZE, data + data_off, len);
+			bwrite(db, out);
+		}
 		
 		wr += len;
 		data_off += len;
@@ -0,0 +1,17 @@
+// Mount an LFS volume over a directory.
+//   mount disk dir    disk is an IDE disk number, 3 for make VOLUME=1
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(int argc, char *argv[])
+{
+  if(argc != 3){
+    printf(2, "Usage: mount disk dir\n");
+    exit();
+  }
+  if(mount(atoi(argv[1]), argv[2]) < 0)
+    printf(2, "mount %s %s: failed\n", argv[1], argv[2]);
+  exit();
+}
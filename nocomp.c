@@ -0,0 +1,23 @@
+// Turn compression off for files, or back on with -u.
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int i, fd, on;
+
+  on = argc > 1 && strcmp(argv[1], "-u") == 0;
+  if(argc < 2 + on){
+    printf(2, "usage: nocomp [-u] file...\n");
+    exit();
+  }
+  for(i = 1 + on; i < argc; i++){
+    if((fd = open(argv[i], 0)) < 0 || compress(fd, on) < 0)
+      printf(2, "nocomp: cannot set %s\n", argv[i]);
+    if(fd >= 0)
+      close(fd);
+  }
+  exit();
+}
@@ -3,10 +3,16 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NBUF         10  // size of disk block cache
+#define NBUF         10  // least buffers the cache keeps beside the log heads'
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define USERTOP  0xA0000 // end of user address space
 #define PHYSTOP  0x1000000 // use phys mem up to here as free pool
 #define MAXARG       32  // max exec arguments
+#define MAXSEGS    1024  // maximum log segments on the root disk
+#define NDEDUP     1024  // most entries in the dedup fingerprint index
+#define NMOUNT        3  // mounted LFS volumes, the root included
+#define NREADAHEAD    2  // most blocks being read ahead at once
+#define BCACHEPCT    50  // percent of free memory the buffer cache takes
+#define NCLUSTER     16  // blocks read together on a cache miss
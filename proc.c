@@ -99,6 +99,20 @@ userinit(void)
   p->state = RUNNABLE;
 }
 
+// Start a kernel thread running fn, which must never return.
+void
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0 || (p->pgdir = setupkvm()) == 0)
+    panic("kproc");
+  // forkret returns to fn instead of trapret
+  *(uint*)((char*)p->context + sizeof *p->context) = (uint)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -382,6 +396,43 @@ wakeup(void *chan)
   release(&ptable.lock);
 }
 
+// Sleep on wait queue q, guarded by lk, until wakeupq(q).
+// Waiters are queued in the order they come.
+void
+sleepq(struct proc **q, struct spinlock *lk)
+{
+  struct proc **pp;
+
+  proc->wnext = 0;
+  for(pp = q; *pp; pp = &(*pp)->wnext)
+    ;
+  *pp = proc;
+  sleep(q, lk);
+  // kill wakes a process without taking it off
+  for(pp = q; *pp; pp = &(*pp)->wnext)
+    if(*pp == proc){
+      *pp = proc->wnext;
+      break;
+    }
+}
+
+// Wake up the processes on wait queue q, and only them, instead of
+// looking through every process.  Caller holds q's lock.
+void
+wakeupq(struct proc **q)
+{
+  struct proc *p;
+
+  if(*q == 0)
+    return;
+  acquire(&ptable.lock);
+  for(p = *q; p; p = p->wnext)
+    if(p->state == SLEEPING && p->chan == q)
+      p->state = RUNNABLE;
+  release(&ptable.lock);
+  *q = 0;
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -0,0 +1,91 @@
+// Take, drop and read snapshots.
+//   snap              take one and print its number
+//   snap rm n         drop snapshot n
+//   snap ls n [dir]   list a directory in snapshot n
+//   snap cat n file   print a file from snapshot n
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+
+char buf[512];
+
+void
+ls(int n, char *path)
+{
+  char name[512], *p;
+  int fd, fd1;
+  struct dirent de;
+  struct stat st;
+
+  if((fd = snapopen(n, path)) < 0){
+    printf(2, "snap: cannot open %s in snapshot %d\n", path, n);
+    return;
+  }
+  if(fstat(fd, &st) < 0 || st.type != T_DIR ||
+     strlen(path) + 1 + DIRSIZ + 1 > sizeof name){
+    printf(1, "%s %d %d %d\n", path, st.type, st.ino, st.size);
+    close(fd);
+    return;
+  }
+  strcpy(name, path);
+  p = name + strlen(name);
+  *p++ = '/';
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum == 0)
+      continue;
+    memmove(p, de.name, DIRSIZ);
+    p[DIRSIZ] = 0;
+    if((fd1 = snapopen(n, name)) < 0){
+      printf(1, "snap: cannot stat %s\n", name);
+      continue;
+    }
+    fstat(fd1, &st);
+    close(fd1);
+    printf(1, "%s %d %d %d\n", p, st.type, st.ino, st.size);
+  }
+  close(fd);
+}
+
+void
+cat(int n, char *path)
+{
+  int fd, cc;
+
+  if((fd = snapopen(n, path)) < 0){
+    printf(2, "snap: cannot open %s in snapshot %d\n", path, n);
+    return;
+  }
+  while((cc = read(fd, buf, sizeof(buf))) > 0)
+    write(1, buf, cc);
+  close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  if(argc < 2){
+    if((n = snapshot()) < 0)
+      printf(2, "snap: no free snapshot slots\n");
+    else
+      printf(1, "snapshot %d\n", n);
+    exit();
+  }
+  if(argc < 3){
+    printf(2, "usage: snap [rm n | ls n [dir] | cat n file]\n");
+    exit();
+  }
+  n = atoi(argv[2]);
+  if(strcmp(argv[1], "rm") == 0){
+    if(snapdelete(n) < 0)
+      printf(2, "snap: cannot delete snapshot %d\n", n);
+  } else if(strcmp(argv[1], "ls") == 0)
+    ls(n, argc > 3 ? argv[3] : "/");
+  else if(strcmp(argv[1], "cat") == 0 && argc > 3)
+    cat(n, argv[3]);
+  else
+    printf(2, "usage: snap [rm n | ls n [dir] | cat n file]\n");
+  exit();
+}
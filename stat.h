@@ -9,3 +9,31 @@ struct stat {
   short nlink; // Number of links to file
   uint size;   // Size of file in bytes
 };
+
+// log-structured file system counters, from lfsstat()
+struct lfsstat {
+  uint nsegs;      // segments on the device
+  uint nclean;     // segments ready for reuse
+  uint policy;     // CLEAN_GREEDY or CLEAN_COSTBENEFIT
+  uint bsize;      // block size
+  uint segblocks;  // blocks per segment
+  uint userbytes;  // bytes handed to writei
+  uint devbytes;   // bytes the log wrote to disk
+  uint cleaned;    // segments reclaimed by the cleaner
+  uint moved;      // live blocks the cleaner copied forward
+  uint zin;        // bytes the segment writer compressed
+  uint zout;       // what they compressed to
+  uint dedupchecked; // data blocks looked up in the fingerprint index
+  uint deduphits;    // ones that shared an earlier copy instead
+  uint idereqs;    // buffers queued for the disks
+  uint idecmds;    // disk commands they were merged into
+  uint idepolls;   // deep waits that polled the disk
+  uint idesleeps;  // and ones that slept for its interrupts
+  uint pollcost;   // cycles per buffer polling, on average
+  uint intrcost;   // and sleeping
+  uint bhits;      // block lookups the buffer cache had
+  uint bmisses;    // and ones it did not
+  uint bghosts;    // misses on blocks evicted lately, moved to main
+  uint nbuf;       // buffers in the cache now
+  uint bclustered; // blocks read along with a miss
+};
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Rebuild the image for each block and segment size and run geobench
+# under qemu, collecting one line per geometry.
+#
+#   ./sweep.sh [block sizes] -- [segment sizes in KB]
+
+bsizes="1024 2048 4096"
+segkbs="256 512 1024 2048 4096"
+if [ $# -gt 0 ]; then
+  bsizes=""
+  while [ $# -gt 0 ] && [ "$1" != "--" ]; do bsizes="$bsizes $1"; shift; done
+  [ "$1" = "--" ] && shift
+  [ $# -gt 0 ] && segkbs="$*"
+fi
+
+for b in $bsizes; do
+  for s in $segkbs; do
+    make clean >/dev/null
+    if ! make BSIZE=$b MKFSFLAGS="-g $s" fs.img xv6.img >/dev/null 2>&1; then
+      echo "bsize $b segkb $s: build failed"
+      continue
+    fi
+    (sleep 5; echo geobench; sleep 30) |
+      timeout 60 make BSIZE=$b MKFSFLAGS="-g $s" qemu-nox 2>/dev/null |
+      grep '^geobench' || echo "bsize $b segkb $s: no result"
+  done
+done
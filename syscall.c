@@ -97,6 +97,27 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_sync(void);
+extern int sys_lfsstat(void);
+extern int sys_lfssegs(void);
+extern int sys_lfssum(void);
+extern int sys_lfsbmapv(void);
+extern int sys_lfsmarkv(void);
+extern int sys_lfssegclean(void);
+extern int sys_lfscleaner(void);
+extern int sys_fmap(void);
+extern int sys_defrag(void);
+extern int sys_snapshot(void);
+extern int sys_snapdelete(void);
+extern int sys_snapopen(void);
+extern int sys_reflink(void);
+extern int sys_compress(void);
+extern int sys_dedup(void);
+extern int sys_lseek(void);
+extern int sys_punch(void);
+extern int sys_mount(void);
+extern int sys_fsync(void);
+extern int sys_lfspolicy(void);
 
 static int (*syscalls[])(void) = {
 [SYS_chdir]   sys_chdir,
@@ -120,6 +141,27 @@ static int (*syscalls[])(void) = {
 [SYS_wait]    sys_wait,
 [SYS_write]   sys_write,
 [SYS_uptime]  sys_uptime,
+[SYS_sync]    sys_sync,
+[SYS_lfsstat] sys_lfsstat,
+[SYS_lfssegs] sys_lfssegs,
+[SYS_lfssum] sys_lfssum,
+[SYS_lfsbmapv] sys_lfsbmapv,
+[SYS_lfsmarkv] sys_lfsmarkv,
+[SYS_lfssegclean] sys_lfssegclean,
+[SYS_lfscleaner] sys_lfscleaner,
+[SYS_fmap]    sys_fmap,
+[SYS_defrag]  sys_defrag,
+[SYS_snapshot] sys_snapshot,
+[SYS_snapdelete] sys_snapdelete,
+[SYS_snapopen] sys_snapopen,
+[SYS_reflink]  sys_reflink,
+[SYS_compress] sys_compress,
+[SYS_dedup]    sys_dedup,
+[SYS_lseek]    sys_lseek,
+[SYS_punch]    sys_punch,
+[SYS_mount]    sys_mount,
+[SYS_fsync]    sys_fsync,
+[SYS_lfspolicy] sys_lfspolicy,
 };
 
 void
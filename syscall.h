@@ -20,3 +20,24 @@
 #define SYS_sbrk   19
 #define SYS_sleep  20
 #define SYS_uptime 21
+#define SYS_sync   22
+#define SYS_lfsstat 23
+#define SYS_lfssegs 24
+#define SYS_lfssum 25
+#define SYS_lfsbmapv 26
+#define SYS_lfsmarkv 27
+#define SYS_lfssegclean 28
+#define SYS_lfscleaner 29
+#define SYS_fmap   30
+#define SYS_defrag 31
+#define SYS_snapshot 32
+#define SYS_snapdelete 33
+#define SYS_snapopen 34
+#define SYS_reflink 35
+#define SYS_compress 36
+#define SYS_dedup 37
+#define SYS_lseek 38
+#define SYS_punch 39
+#define SYS_mount 40
+#define SYS_fsync 41
+#define SYS_lfspolicy 42
@@ -105,6 +105,51 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Copy the disk addresses of an open file's blocks, for measuring
+// fragmentation.  Returns the number of blocks copied.
+int
+sys_fmap(void)
+{
+  struct file *f;
+  uint *addrs;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || n < 0)
+    return -1;
+  // no file has more blocks than that
+  if(n > MAXFILE)
+    n = MAXFILE;
+  if(argptr(1, (void*)&addrs, n*sizeof(*addrs)) < 0)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  n = ifmap(f->ip, addrs, n);
+  iunlock(f->ip);
+  return n;
+}
+
+// Relog an open file's blocks contiguously.  Returns the number of
+// blocks moved.
+int
+sys_defrag(void)
+{
+  struct file *f;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+    return -1;
+  cleanreserve();
+  ilock(f->ip);
+  if(f->ip->type != T_FILE || f->ip->snap){
+    iunlock(f->ip);
+    return -1;
+  }
+  n = idefrag(f->ip);
+  iunlock(f->ip);
+  return n;
+}
+
 // Create the path new as a link to the same inode as old.
 int
 sys_link(void)
@@ -160,16 +205,15 @@ isdirempty(struct inode *dp)
   return 1;
 }
 
-int
-sys_unlink(void)
+// Remove path's directory entry, if it names want or want is 0.
+static int
+unlink(char *path, struct inode *want)
 {
   struct inode *ip, *dp;
   struct dirent de;
-  char name[DIRSIZ], *path;
+  char name[DIRSIZ];
   uint off;
 
-  if(argstr(0, &path) < 0)
-    return -1;
   if((dp = nameiparent(path, name)) == 0)
     return -1;
   ilock(dp);
@@ -180,7 +224,9 @@ sys_unlink(void)
     return -1;
   }
 
-  if((ip = dirlookup(dp, name, &off)) == 0){
+  if((ip = dirlookup(dp, name, &off)) == 0 || (want && ip != want)){
+    if(ip)
+      iput(ip);
     iunlockput(dp);
     return -1;
   }
@@ -188,7 +234,7 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if(ip->type == T_DIR && (!isdirempty(ip) || imounted(ip))){
     iunlockput(ip);
     iunlockput(dp);
     return -1;
@@ -209,6 +255,138 @@ sys_unlink(void)
   return 0;
 }
 
+int
+sys_unlink(void)
+{
+  char *path;
+
+  if(argstr(0, &path) < 0)
+    return -1;
+  return unlink(path, 0);
+}
+
+// Cleaner control, after BSD LFS.  A user-level cleaner reads the
+// usage table and segment summaries, asks which blocks are still
+// live, has them copied to the head of the log and then marks the
+// segment clean.
+
+// Copy the segment usage table into u[0..n-1].
+int
+sys_lfssegs(void)
+{
+  struct seg_usage *u;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0 || n > MAXSEGS ||
+     argptr(0, (void*)&u, n*sizeof(*u)) < 0)
+    return -1;
+  return segusage(u, n);
+}
+
+// Read the segment summary at block b.
+int
+sys_lfssum(void)
+{
+  struct seg_summary *sum;
+  int b;
+
+  if(argint(0, &b) < 0 || argptr(1, (void*)&sum, sizeof(*sum)) < 0)
+    return -1;
+  if(b < SEGSTART || B2SEG(b) >= getsb(ROOTDEV)->nsegs)
+    return -1;
+  return segsummary(ROOTDEV, b, sum) ? 0 : -1;
+}
+
+// Fetch the blk_info array argument, at most a summary's worth,
+// and check each entry names a block of the root volume and, unless
+// it is an imap or a pack, an inode it can have.
+static int
+argblks(struct blk_info **bi, int *n)
+{
+  struct disk_superblock *sb = getsb(ROOTDEV);
+  struct blk_info *b;
+
+  if(argint(1, n) < 0 || *n < 0 || *n > SUMENTRIES ||
+     argptr(0, (void*)bi, *n*sizeof(**bi)) < 0)
+    return -1;
+  for(b = *bi; b < *bi + *n; b++){
+    if(b->addr < SEGSTART || b->addr >= sb->nblocks)
+      return -1;
+    if(b->bn != BN_IMAP && b->bn != BN_PACK &&
+       (b->inum == 0 || b->inum >= sb->ninodes))
+      return -1;
+  }
+  return 0;
+}
+
+// Set bi[i].live for each of n blocks.
+int
+sys_lfsbmapv(void)
+{
+  struct blk_info *bi;
+  int i, n;
+
+  if(argblks(&bi, &n) < 0)
+    return -1;
+  for(i = 0; i < n; i++)
+    bi[i].live = blive(ROOTDEV, bi[i].inum, bi[i].bn, bi[i].addr);
+  return 0;
+}
+
+// Copy each of n blocks that is still live to the head of the log.
+// Returns how many could not be moved.
+int
+sys_lfsmarkv(void)
+{
+  struct blk_info *bi;
+  int i, n, stuck;
+
+  if(argblks(&bi, &n) < 0)
+    return -1;
+  stuck = 0;
+  for(i = 0; i < n; i++){
+    if(irelog(ROOTDEV, bi[i].inum, bi[i].bn, bi[i].addr, 0) < 0)
+      stuck++;
+    else
+      lfsstat.moved++;
+  }
+  return stuck;
+}
+
+// Mark a segment whose live blocks have all been moved clean.
+int
+sys_lfssegclean(void)
+{
+  int s;
+
+  if(argint(0, &s) < 0 || s < 0)
+    return -1;
+  return segmarkclean(s);
+}
+
+// Turn the kernel's cleaner thread on or off.
+int
+sys_lfscleaner(void)
+{
+  int on;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  return cleanerctl(on);
+}
+
+// Set the cleaner's victim policy at run time.  Returns the old one.
+int
+sys_lfspolicy(void)
+{
+  int policy;
+
+  if(argint(0, &policy) < 0 ||
+     (policy != CLEAN_GREEDY && policy != CLEAN_COSTBENEFIT))
+    return -1;
+  return cleanpolicy(policy);
+}
+
 static struct inode*
 create(char *path, short type, short major, short minor)
 {
@@ -216,6 +394,7 @@ create(char *path, short type, short major, short minor)
   struct inode *ip, *dp;
   char name[DIRSIZ];
 
+  cleanreserve();
   if((dp = nameiparent(path, name)) == 0)
     return 0;
   ilock(dp);
@@ -292,6 +471,177 @@ sys_open(void)
   return fd;
 }
 
+// Turn compression of fd's file on or off for what is written from
+// now on.  Returns the old setting.
+int
+sys_compress(void)
+{
+  struct file *f;
+  int on, old;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &on) < 0 || f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  if(f->ip->type != T_FILE || f->ip->snap){
+    iunlock(f->ip);
+    return -1;
+  }
+  old = (f->ip->fflags & F_NOCOMPRESS) == 0;
+  if(on)
+    f->ip->fflags &= ~F_NOCOMPRESS;
+  else
+    f->ip->fflags |= F_NOCOMPRESS;
+  iupdate(f->ip);
+  iunlock(f->ip);
+  return old;
+}
+
+// Move fd's offset.  SEEK_DATA and SEEK_HOLE find the next data or
+// hole at or after off.  Returns the new offset.
+int
+sys_lseek(void)
+{
+  struct file *f;
+  int off, whence, r;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &whence) < 0)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  switch(whence){
+  case SEEK_SET:
+    r = off;
+    break;
+  case SEEK_CUR:
+    r = f->off + off;
+    break;
+  case SEEK_END:
+    r = f->ip->size + off;
+    break;
+  case SEEK_DATA:
+  case SEEK_HOLE:
+    r = off < 0 ? -1 : iseekdata(f->ip, off, whence == SEEK_HOLE);
+    break;
+  default:
+    r = -1;
+  }
+  iunlock(f->ip);
+  if(r < 0)
+    return -1;
+  f->off = r;
+  return r;
+}
+
+// Free bytes off..off+n-1 of fd's file, leaving a hole that reads
+// as zeroes.
+int
+sys_punch(void)
+{
+  struct file *f;
+  int off, n, r;
+
+  if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(f->type != FD_INODE || !f->writable || off < 0 || n < 0)
+    return -1;
+  cleanreserve();
+  ilock(f->ip);
+  r = -1;
+  if(f->ip->type == T_FILE && !f->ip->snap)
+    r = ipunch(f->ip, off, n);
+  iunlock(f->ip);
+  return r;
+}
+
+// Size the dedup fingerprint index, or turn deduplication off with
+// 0.  Returns the old size.
+int
+sys_dedup(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0 || n < 0)
+    return -1;
+  return bdedup(n);
+}
+
+// Create the file new as a copy of old that shares its blocks.
+int
+sys_reflink(void)
+{
+  char *new, *old;
+  struct inode *dp, *ip;
+
+  if(argstr(0, &old) < 0 || argstr(1, &new) < 0)
+    return -1;
+  if((ip = namei(old)) == 0)
+    return -1;
+  if((dp = create(new, T_FILE, 0, 0)) == 0){
+    iput(ip);
+    return -1;
+  }
+  // iclone locks the two in a fixed order
+  iunlock(dp);
+  if(iclone(dp, ip) < 0){
+    // leave no empty file behind
+    unlink(new, dp);
+    iput(dp);
+    iput(ip);
+    return -1;
+  }
+  iput(dp);
+  iput(ip);
+  return 0;
+}
+
+// Pin the current checkpoint.  Returns the snapshot number.
+int
+sys_snapshot(void)
+{
+  return snapcreate();
+}
+
+int
+sys_snapdelete(void)
+{
+  int k;
+
+  if(argint(0, &k) < 0)
+    return -1;
+  return snapdelete(k);
+}
+
+// Open path in snapshot k, read-only.
+int
+sys_snapopen(void)
+{
+  char *path;
+  int fd, k;
+  struct file *f;
+  struct inode *ip;
+
+  if(argint(0, &k) < 0 || argstr(1, &path) < 0)
+    return -1;
+  if((ip = namesnap(k, path)) == 0)
+    return -1;
+  ilock(ip);
+  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
+    if(f)
+      fileclose(f);
+    iunlockput(ip);
+    return -1;
+  }
+  iunlock(ip);
+
+  f->type = FD_INODE;
+  f->ip = ip;
+  f->off = 0;
+  f->readable = 1;
+  f->writable = 0;
+  return fd;
+}
+
 int
 sys_mkdir(void)
 {
@@ -366,6 +716,73 @@ sys_exec(void)
   return exec(path, argv);
 }
 
+// Push pending log blocks of every volume to disk as partial
+// segments.
+int
+sys_sync(void)
+{
+  int v;
+
+  for(v = 0; v < NMOUNT; v++)
+    if(lfsdev(v) != 0)
+      bsync(lfsdev(v));
+  return 0;
+}
+
+// Make an open file's contents durable.
+int
+sys_fsync(void)
+{
+  struct file *f;
+  int r;
+
+  if(argfd(0, 0, &f) < 0 || f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  r = ifsync(f->ip);
+  iunlock(f->ip);
+  return r;
+}
+
+// Mount the file system on IDE disk dev over directory path.
+int
+sys_mount(void)
+{
+  char *path;
+  int dev;
+  struct inode *ip;
+
+  if(argint(0, &dev) < 0 || dev < 0 || argstr(1, &path) < 0)
+    return -1;
+  if((ip = namei(path)) == 0)
+    return -1;
+  ilock(ip);
+  // a volume's root is already where a volume is mounted
+  if(ip->type != T_DIR || ip->snap || ip->inum == ROOTINO){
+    iunlockput(ip);
+    return -1;
+  }
+  // mount locks ip itself, around recovery but not through it
+  iunlock(ip);
+  if(imount(dev, ip) < 0){
+    iput(ip);
+    return -1;
+  }
+  return 0;
+}
+
+// Report segment cleaning and write amplification counters.
+int
+sys_lfsstat(void)
+{
+  struct lfsstat *st;
+
+  if(argptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  segstat(st);
+  return 0;
+}
+
 int
 sys_pipe(void)
 {
@@ -1,4 +1,8 @@
 struct stat;
+struct lfsstat;
+struct seg_summary;
+struct seg_usage;
+struct blk_info;
 
 // system calls
 int fork(void);
@@ -22,6 +26,27 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int sync(void);
+int lfsstat(struct lfsstat*);
+int lfssegs(struct seg_usage*, int);
+int lfssum(uint, struct seg_summary*);
+int lfsbmapv(struct blk_info*, int);
+int lfsmarkv(struct blk_info*, int);
+int lfssegclean(int);
+int lfscleaner(int);
+int fmap(int, uint*, int);
+int defrag(int);
+int snapshot(void);
+int snapdelete(int);
+int snapopen(int, char*);
+int reflink(char*, char*);
+int compress(int, int);
+int dedup(int);
+int lseek(int, int, int);
+int punch(int, int, int);
+int mount(int, char*);
+int fsync(int);
+int lfspolicy(int);
 
 // ulib.c
 int stat(char*, struct stat*);
@@ -36,3 +61,7 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+
+// crc.c
+uint crc32c(uint, const void*, uint);
+int crc32cmode(int);
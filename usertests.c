@@ -1,12 +1,14 @@
 #include "types.h"
 #include "stat.h"
 #include "user.h"
+#include "param.h"
 #include "fs.h"
 #include "fcntl.h"
 #include "syscall.h"
 #include "traps.h"
 
 char buf[2048];
+char sbuf[BSIZE];
 char name[3];
 char *echoargv[] = { "echo", "ALL", "TESTS", "PASSED", 0 };
 int stdout = 1;
@@ -139,6 +141,418 @@ writetest1(void)
   printf(stdout, "big files ok\n");
 }
 
+// write past the end, read the hole back, punch another one
+void
+sparsetest(void)
+{
+  int fd, i;
+
+  printf(stdout, "sparse file test\n");
+  fd = open("sparse", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat sparse failed!\n");
+    exit();
+  }
+  memset(sbuf, 'x', BSIZE);
+  if(lseek(fd, 3*BSIZE, SEEK_SET) != 3*BSIZE || write(fd, sbuf, BSIZE) != BSIZE){
+    printf(stdout, "error: write past end failed\n");
+    exit();
+  }
+  if(lseek(fd, 0, SEEK_DATA) != 3*BSIZE || lseek(fd, 0, SEEK_HOLE) != 0){
+    printf(stdout, "error: seek data/hole wrong\n");
+    exit();
+  }
+  lseek(fd, BSIZE, SEEK_SET);
+  if(read(fd, sbuf, BSIZE) != BSIZE){
+    printf(stdout, "error: read hole failed\n");
+    exit();
+  }
+  for(i = 0; i < BSIZE; i++)
+    if(sbuf[i] != 0){
+      printf(stdout, "error: hole is not zero\n");
+      exit();
+    }
+  if(punch(fd, 3*BSIZE, BSIZE) < 0 || lseek(fd, 0, SEEK_DATA) >= 0){
+    printf(stdout, "error: punch failed\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("sparse") < 0){
+    printf(stdout, "unlink sparse failed\n");
+    exit();
+  }
+  printf(stdout, "sparse file test ok\n");
+}
+
+// rewrite a flushed file and fsync it, which goes to the intent
+// log when there is one
+void
+fsynctest(void)
+{
+  int fd;
+
+  printf(stdout, "fsync test\n");
+  fd = open("fsync", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat fsync failed!\n");
+    exit();
+  }
+  memset(sbuf, 'a', BSIZE);
+  if(write(fd, sbuf, BSIZE) != BSIZE || sync() < 0){
+    printf(stdout, "error: write fsync failed\n");
+    exit();
+  }
+  memset(sbuf, 'b', BSIZE);
+  lseek(fd, 0, SEEK_SET);
+  if(write(fd, sbuf, BSIZE) != BSIZE || fsync(fd) < 0){
+    printf(stdout, "error: fsync failed\n");
+    exit();
+  }
+  memset(sbuf, 0, BSIZE);
+  lseek(fd, 0, SEEK_SET);
+  if(read(fd, sbuf, BSIZE) != BSIZE || sbuf[0] != 'b' || sbuf[BSIZE-1] != 'b'){
+    printf(stdout, "error: read after fsync wrong\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("fsync") < 0){
+    printf(stdout, "unlink fsync failed\n");
+    exit();
+  }
+  printf(stdout, "fsync test ok\n");
+}
+
+// fill the first n blocks of fd with c, c+1, ...
+void
+fillblocks(int fd, int c, int n)
+{
+  int i;
+
+  lseek(fd, 0, SEEK_SET);
+  for(i = 0; i < n; i++){
+    memset(sbuf, c + i, BSIZE);
+    if(write(fd, sbuf, BSIZE) != BSIZE){
+      printf(stdout, "error: write failed\n");
+      exit();
+    }
+  }
+}
+
+// do the first n blocks of fd hold what fillblocks(fd, c, n) wrote?
+int
+sameblocks(int fd, int c, int n)
+{
+  int i, k;
+
+  lseek(fd, 0, SEEK_SET);
+  for(i = 0; i < n; i++){
+    if(read(fd, sbuf, BSIZE) != BSIZE)
+      return 0;
+    for(k = 0; k < BSIZE; k++)
+      if(sbuf[k] != c + i)
+        return 0;
+  }
+  return 1;
+}
+
+// a snapshot keeps a file as it was, and can't be dropped while open
+void
+snaptest(void)
+{
+  int fd, sfd, n;
+
+  printf(stdout, "snapshot test\n");
+  fd = open("snapf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat snapf failed!\n");
+    exit();
+  }
+  fillblocks(fd, 'a', 2);
+  if((n = snapshot()) < 0){
+    printf(stdout, "error: snapshot failed\n");
+    exit();
+  }
+  fillblocks(fd, 'x', 2);
+  if((sfd = snapopen(n, "snapf")) < 0){
+    printf(stdout, "error: snapopen failed\n");
+    exit();
+  }
+  if(!sameblocks(sfd, 'a', 2) || !sameblocks(fd, 'x', 2)){
+    printf(stdout, "error: snapshot sees a later write\n");
+    exit();
+  }
+  if(write(sfd, "z", 1) >= 0 || snapdelete(n) >= 0){
+    printf(stdout, "error: snapshot written or dropped while open\n");
+    exit();
+  }
+  close(sfd);
+  if(snapdelete(n) < 0 || snapopen(n, "snapf") >= 0){
+    printf(stdout, "error: snapdelete failed\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("snapf") < 0){
+    printf(stdout, "unlink snapf failed\n");
+    exit();
+  }
+  printf(stdout, "snapshot test ok\n");
+}
+
+// a reflinked copy shares blocks until one side writes
+void
+reflinktest(void)
+{
+  int fd;
+
+  printf(stdout, "reflink test\n");
+  fd = open("rlsrc", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat rlsrc failed!\n");
+    exit();
+  }
+  fillblocks(fd, 'a', 3);
+  close(fd);
+  if(reflink("rlsrc", "rldst") < 0){
+    printf(stdout, "error: reflink failed\n");
+    exit();
+  }
+  fd = open("rldst", O_RDWR);
+  if(fd < 0 || !sameblocks(fd, 'a', 3)){
+    printf(stdout, "error: reflinked copy wrong\n");
+    exit();
+  }
+  fillblocks(fd, 'k', 1);
+  close(fd);
+  fd = open("rlsrc", 0);
+  if(!sameblocks(fd, 'a', 3)){
+    printf(stdout, "error: write to the copy changed the source\n");
+    exit();
+  }
+  close(fd);
+  fd = open("rldst", 0);
+  if(!sameblocks(fd, 'k', 1)){
+    printf(stdout, "error: write to the copy lost\n");
+    exit();
+  }
+  close(fd);
+  if(reflink(".", "rlbad") >= 0 || open("rlbad", 0) >= 0){
+    printf(stdout, "error: reflink of a directory\n");
+    exit();
+  }
+  if(unlink("rlsrc") < 0 || unlink("rldst") < 0){
+    printf(stdout, "unlink reflink files failed\n");
+    exit();
+  }
+  printf(stdout, "reflink test ok\n");
+}
+
+// data reads back the same with compression on and off
+void
+compresstest(void)
+{
+  int fd;
+
+  printf(stdout, "compress test\n");
+  fd = open("compf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat compf failed!\n");
+    exit();
+  }
+  if(compress(fd, 0) != 1 || compress(fd, 1) != 0){
+    printf(stdout, "error: compress flag wrong\n");
+    exit();
+  }
+  fillblocks(fd, 'a', 4);
+  sync();
+  if(!sameblocks(fd, 'a', 4)){
+    printf(stdout, "error: compressed data wrong\n");
+    exit();
+  }
+  compress(fd, 0);
+  fillblocks(fd, 'k', 4);
+  sync();
+  if(!sameblocks(fd, 'k', 4)){
+    printf(stdout, "error: uncompressed data wrong\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("compf") < 0){
+    printf(stdout, "unlink compf failed\n");
+    exit();
+  }
+  printf(stdout, "compress test ok\n");
+}
+
+// two files with the same blocks, then one overwritten
+void
+deduptest(void)
+{
+  int fd1, fd2;
+
+  printf(stdout, "dedup test\n");
+  fd1 = open("dup1", O_CREATE|O_RDWR);
+  fd2 = open("dup2", O_CREATE|O_RDWR);
+  if(fd1 < 0 || fd2 < 0){
+    printf(stdout, "error: creat dup failed!\n");
+    exit();
+  }
+  fillblocks(fd1, 'd', 3);
+  sync();
+  fillblocks(fd2, 'd', 3);
+  sync();
+  fillblocks(fd1, 'q', 1);
+  sync();
+  if(!sameblocks(fd2, 'd', 3) || !sameblocks(fd1, 'q', 1)){
+    printf(stdout, "error: overwrite reached the duplicate\n");
+    exit();
+  }
+  close(fd1);
+  close(fd2);
+  if(unlink("dup1") < 0 || unlink("dup2") < 0){
+    printf(stdout, "unlink dup failed\n");
+    exit();
+  }
+  printf(stdout, "dedup test ok\n");
+}
+
+struct seg_usage use[MAXSEGS];
+struct seg_summary sum;
+struct blk_info bi[PARTBLOCKS];
+uint segblocks;
+
+// move a file's segment out from under it, as cleand does
+void
+cleantest(void)
+{
+  struct lfsstat st;
+  block_t start;
+  uint addr, serial, k;
+  int fd, s, n, on;
+
+  printf(stdout, "clean test\n");
+  fd = open("cleanf", O_CREATE|O_RDWR);
+  if(fd < 0 || lfsstat(&st) < 0){
+    printf(stdout, "error: creat cleanf failed!\n");
+    exit();
+  }
+  segblocks = st.segblocks;
+  fillblocks(fd, 'c', 4);
+  sync();
+  if(fmap(fd, &addr, 1) != 1){
+    printf(stdout, "error: fmap failed\n");
+    exit();
+  }
+  s = B2SEG(PACKBLOCK(addr));
+  on = lfscleaner(0);
+  serial = 0;
+  for(start = SEG2B(s); lfssum(start, &sum) == 0 && sum.serial > serial; start = sum.next){
+    serial = sum.serial;
+    for(k = 0; k < sum.nblocks; k++){
+      bi[k].inum = sum.entries[k].inum;
+      bi[k].bn = sum.entries[k].bn;
+      bi[k].addr = start + SEGMETABLOCKS + k;
+    }
+    if(lfsbmapv(bi, sum.nblocks) < 0){
+      printf(stdout, "error: lfsbmapv failed\n");
+      exit();
+    }
+    for(n = k = 0; k < sum.nblocks; k++)
+      if(bi[k].live)
+        bi[n++] = bi[k];
+    if(lfsmarkv(bi, n) != 0){
+      printf(stdout, "error: lfsmarkv failed\n");
+      exit();
+    }
+    if(B2SEG(sum.next) != s)
+      break;
+  }
+  sync();
+  // a log head may still be writing there
+  if(lfssegs(use, MAXSEGS) > s && (use[s].flags & SEG_ACTIVE) == 0)
+    lfssegclean(s);
+  lfscleaner(on);
+  if(!sameblocks(fd, 'c', 4)){
+    printf(stdout, "error: data lost moving its segment\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("cleanf") < 0){
+    printf(stdout, "unlink cleanf failed\n");
+    exit();
+  }
+  printf(stdout, "clean test ok\n");
+}
+
+// relogging a file in block order keeps its data
+void
+defragtest(void)
+{
+  int fd;
+
+  printf(stdout, "defrag test\n");
+  fd = open("defragf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat defragf failed!\n");
+    exit();
+  }
+  fillblocks(fd, 'f', 4);
+  sync();
+  if(defrag(fd) < 0 || !sameblocks(fd, 'f', 4)){
+    printf(stdout, "error: defrag lost data\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("defragf") < 0){
+    printf(stdout, "unlink defragf failed\n");
+    exit();
+  }
+  printf(stdout, "defrag test ok\n");
+}
+
+// the second volume, if there is one (make VOLUME=1), holds README
+// too; it is left mounted
+void
+mounttest(void)
+{
+  int fd1, fd2, n1, n2, k;
+
+  printf(stdout, "mount test\n");
+  if(mkdir("mnt") < 0){
+    printf(stdout, "error: mkdir mnt failed\n");
+    exit();
+  }
+  if(mount(3, "mnt") < 0){
+    unlink("mnt");
+    printf(stdout, "mount test skipped, no volume on disk 3\n");
+    return;
+  }
+  fd1 = open("README", 0);
+  fd2 = open("mnt/README", 0);
+  if(fd1 < 0 || fd2 < 0){
+    printf(stdout, "error: open through mount failed\n");
+    exit();
+  }
+  n1 = read(fd1, buf, BSIZE);
+  n2 = read(fd2, sbuf, BSIZE);
+  if(n1 <= 0 || n1 != n2){
+    printf(stdout, "error: read through mount failed\n");
+    exit();
+  }
+  for(k = 0; k < n1; k++)
+    if(buf[k] != sbuf[k]){
+      printf(stdout, "error: read through mount wrong\n");
+      exit();
+    }
+  close(fd1);
+  close(fd2);
+  if(unlink("mnt") >= 0 || (fd1 = open("mnt/../README", 0)) < 0){
+    printf(stdout, "error: mount point unlinked or .. wrong\n");
+    exit();
+  }
+  close(fd1);
+  printf(stdout, "mount test ok\n");
+}
+
 void
 createtest(void)
 {
@@ -1480,6 +1894,15 @@ main(int argc, char *argv[])
   opentest();
   writetest();
   writetest1();
+  sparsetest();
+  fsynctest();
+  snaptest();
+  reflinktest();
+  compresstest();
+  deduptest();
+  cleantest();
+  defragtest();
+  mounttest();
   createtest();
 
   mem();
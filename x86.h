@@ -124,6 +124,16 @@ sti(void)
   asm volatile("sti");
 }
 
+// Cycles since reset.
+static inline uint64
+rdtsc(void)
+{
+  uint64 t;
+
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {